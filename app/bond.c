@@ -0,0 +1,462 @@
+#include "bond.h"
+#include "packet.h"
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Bonded transfers stripe the file over several links, in the packets of a single link.
+ * Every link starts with a START packet that carries the chunk size the sender chose,
+ * so both ends count chunks alike whichever links each of them opened, and ends with END.
+ * Every data packet carries the offset of its chunk in the file, so the receiver
+ * can write chunks from any link at their place.
+ * Load balancing is pull based: each link thread takes the next chunk as soon as
+ * its window has room, so every link carries a share proportional to its
+ * observed throughput.
+ * When a link fails, the chunks it may not have delivered (the last windowSize ones)
+ * are queued again for the other links.
+ * Chunks are as large as the smallest payload negotiated on the links the sender opened.
+ */
+
+#define BOND_START_SIZE (1 + 2 * (2 + NUMBER_SIZE)) // START without the name, the smallest payload a link needs
+
+typedef struct bondSender {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int file_desc;
+    const char *name;
+    off_t file_size;
+    int chunk_size;
+    off_t next_offset; // next chunk never sent
+    off_t requeued[MAX_BONDED_LINKS * MAX_WINDOW_SIZE]; // chunks of failed links
+    int requeued_count;
+    int busy; // links with chunks not yet known to be acknowledged
+    int alive;
+} bondSender;
+
+typedef struct bondReceiver {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int file_desc;
+    int chunk_size; // from the first START packet, 0 until then
+    unsigned char *received; // one entry per chunk index
+    long long received_capacity;
+    long long received_chunks;
+    off_t file_size; // -1 until a START packet arrives
+    int running; // link threads still reading
+    int failed; // the file cannot be completed
+} bondReceiver;
+
+typedef struct bondLink {
+    linkLayer parameters;
+    linkConnection *link;
+    bondSender *sender;
+    bondReceiver *receiver;
+    off_t recent[MAX_WINDOW_SIZE]; // last chunks written, they may still be unacknowledged
+    int recent_count;
+    long long bytes;
+    double seconds;
+} bondLink;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Builds the START packet of a link, the name is cut to the room left in the payload; returns its size
+static int start_packet(bondSender *b, unsigned char *packet, int max_payload) {
+    packet[0] = PACKET_START;
+    int size = put_number(packet, 1, FIELD_SIZE, b->file_size);
+    size = put_number(packet, size, FIELD_CHUNK, b->chunk_size);
+    int name_length = strlen(b->name), room = max_payload - size - 2;
+    if (name_length > 255)
+        name_length = 255;
+    if (name_length > room)
+        name_length = room;
+    if (name_length >= 0) {
+        packet[size] = FIELD_NAME;
+        packet[size+1] = name_length;
+        memcpy(packet+size+2, b->name, name_length);
+        size += 2+name_length;
+    }
+    return size;
+}
+
+// Takes a chunk of a failed link first, then the next unsent one; called with the lock held
+static int take_chunk(bondSender *b, off_t *offset) {
+    if (b->requeued_count > 0) {
+        *offset = b->requeued[--b->requeued_count];
+        return TRUE;
+    }
+    if (b->next_offset < b->file_size) {
+        *offset = b->next_offset;
+        b->next_offset += b->chunk_size;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Hands the chunks the link may not have delivered to the other links
+static void link_failed(bondLink *bl, int busy) {
+    bondSender *b = bl->sender;
+    fprintf(stderr, "Link %s failed, moving its chunks to the other links\n", bl->parameters.serialPort);
+    pthread_mutex_lock(&b->lock);
+    for (int i = 0; i < bl->recent_count; i++)
+        b->requeued[b->requeued_count++] = bl->recent[i];
+    if (busy)
+        b->busy--;
+    b->alive--;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+    llclose_link(bl->link, FALSE);
+    bl->link = NULL;
+}
+
+static void *send_link(void *arg) {
+    bondLink *bl = arg;
+    bondSender *b = bl->sender;
+    int max_payload = llmax_payload_link(bl->link);
+    unsigned char *packet = malloc(max_payload);
+    int window = bl->parameters.windowSize > 0 ? bl->parameters.windowSize : 1;
+    int busy = FALSE;
+    double start = now_seconds();
+
+    if (llwrite_link(bl->link, packet, start_packet(b, packet, max_payload)) < 0) {
+        bl->seconds = now_seconds() - start;
+        link_failed(bl, busy);
+        free(packet);
+        return NULL;
+    }
+
+    for (;;) {
+        off_t offset;
+        pthread_mutex_lock(&b->lock);
+        int got = take_chunk(b, &offset);
+        if (got && !busy) {
+            busy = TRUE;
+            b->busy++;
+        }
+        if (!got && !busy) {
+            // Nothing to send: wait in case a busy link fails and its chunks come back
+            while (b->requeued_count == 0 && b->busy > 0)
+                pthread_cond_wait(&b->changed, &b->lock);
+            int more = b->requeued_count > 0;
+            pthread_mutex_unlock(&b->lock);
+            if (more)
+                continue;
+            break;
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        if (!got) {
+            // Queue is empty, make sure the chunks of this link arrived before giving up on them
+            if (llflush_link(bl->link) < 0) {
+                bl->seconds = now_seconds() - start;
+                link_failed(bl, busy);
+                free(packet);
+                return NULL;
+            }
+            pthread_mutex_lock(&b->lock);
+            b->busy--;
+            busy = FALSE;
+            bl->recent_count = 0;
+            pthread_cond_broadcast(&b->changed);
+            pthread_mutex_unlock(&b->lock);
+            continue;
+        }
+
+        int bytes_read = pread(b->file_desc, packet + PACKET_HEADER_SIZE, b->chunk_size, offset);
+        if (bytes_read < 0) {
+            fprintf(stderr, "Error reading file at offset %lld\n", (long long)offset);
+            bytes_read = 0;
+        }
+        packet[0] = PACKET_DATA;
+        put_number(packet, 1, FIELD_OFFSET, offset);
+
+        if (bl->recent_count == window)
+            memmove(bl->recent, bl->recent + 1, (window - 1) * sizeof(off_t));
+        else
+            bl->recent_count++;
+        bl->recent[bl->recent_count - 1] = offset;
+
+        if (llwrite_link(bl->link, packet, PACKET_HEADER_SIZE + bytes_read) < 0) {
+            bl->seconds = now_seconds() - start;
+            link_failed(bl, busy);
+            free(packet);
+            return NULL;
+        }
+        bl->bytes += bytes_read;
+    }
+
+    bl->seconds = now_seconds() - start;
+    packet[0] = PACKET_END;
+    llwrite_link(bl->link, packet, put_number(packet, 1, FIELD_SIZE, b->file_size));
+    llclose_link(bl->link, TRUE);
+    bl->link = NULL;
+    free(packet);
+    return NULL;
+}
+
+int bond_send(linkLayer *links, int link_count, const char *file_path) {
+    bondSender b = {0};
+    bondLink bl[MAX_BONDED_LINKS] = {0};
+    pthread_t threads[MAX_BONDED_LINKS];
+    struct stat st;
+
+    b.file_desc = open(file_path, O_RDONLY);
+    if (b.file_desc < 0 || fstat(b.file_desc, &st) < 0) {
+        fprintf(stderr, "Error opening file: %s\n", file_path);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) { // chunks are read at their offsets, in any order
+        fprintf(stderr, "Bonded links only send regular files, not %s\n", file_path);
+        close(b.file_desc);
+        return -1;
+    }
+    b.file_size = st.st_size;
+    b.name = strrchr(file_path, '/') != NULL ? strrchr(file_path, '/')+1 : file_path;
+    b.chunk_size = MAX_PAYLOAD_LIMIT;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.changed, NULL);
+
+    for (int i = 0; i < link_count; i++) {
+        bl[i].parameters = links[i];
+        bl[i].sender = &b;
+        bl[i].link = llopen_link(links[i]);
+        if (bl[i].link == NULL) {
+            fprintf(stderr, "Could not initialize link layer connection on %s\n", links[i].serialPort);
+            continue;
+        }
+        if (llmax_payload_link(bl[i].link) < BOND_START_SIZE) {
+            fprintf(stderr, "The payload of %s cannot carry a START packet of %d bytes\n", links[i].serialPort, BOND_START_SIZE);
+            llclose_link(bl[i].link, FALSE);
+            bl[i].link = NULL;
+            continue;
+        }
+        if (llmax_payload_link(bl[i].link) - PACKET_HEADER_SIZE < b.chunk_size)
+            b.chunk_size = llmax_payload_link(bl[i].link) - PACKET_HEADER_SIZE;
+        b.alive++;
+    }
+    if (b.alive == 0 || b.chunk_size <= 0) {
+        fprintf(stderr, "No link can carry chunks of the file\n");
+        close(b.file_desc);
+        return -1;
+    }
+
+    int started[MAX_BONDED_LINKS];
+    for (int i = 0; i < link_count; i++) {
+        started[i] = bl[i].link != NULL;
+        if (started[i])
+            pthread_create(&threads[i], NULL, send_link, &bl[i]);
+    }
+    for (int i = 0; i < link_count; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    long long total = 0;
+    for (int i = 0; i < link_count; i++) {
+        total += bl[i].bytes;
+        if (bl[i].seconds > 0)
+            printf("Link %s: %lld bytes in %.2f s (%.0f B/s)\n", bl[i].parameters.serialPort, bl[i].bytes, bl[i].seconds, bl[i].bytes / bl[i].seconds);
+    }
+    printf("App layer: %lld bytes sent for a %lld byte file, %d of %d links left\n", total, (long long)b.file_size, b.alive, link_count);
+
+    close(b.file_desc);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.changed);
+    return b.alive > 0 && b.requeued_count == 0 && b.next_offset >= b.file_size ? 0 : -1;
+}
+
+/*
+ * Takes the file size and chunk size of the START packet of a link, every link sends the same ones;
+ * a shorter file than the one written before loses the bytes after its end. Called with the lock held
+ */
+static int start_received(bondReceiver *r, const unsigned char *packet, int size) {
+    int size_value, chunk_value, length;
+    if ((size_value = find_field(packet, size, FIELD_SIZE, &length)) < 0 || (chunk_value = find_field(packet, size, FIELD_CHUNK, &length)) < 0) {
+        fprintf(stderr, "START packet without the file or chunk size\n");
+        return -1;
+    }
+    off_t file_size = get_number(packet+size_value, length);
+    long long chunk_size = get_number(packet+chunk_value, length);
+    if (r->chunk_size == 0) {
+        if (chunk_size <= 0 || file_size < 0 || ftruncate(r->file_desc, file_size) < 0) {
+            fprintf(stderr, "Cannot receive a %lld byte file in %lld byte chunks\n", (long long)file_size, chunk_size);
+            return -1;
+        }
+        r->chunk_size = chunk_size;
+        r->file_size = file_size;
+    } else if (chunk_size != r->chunk_size || file_size != r->file_size) {
+        fprintf(stderr, "The links announced different files\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Marks a chunk as received, returns -1 if it cannot be counted; called with the lock held
+static int chunk_received(bondReceiver *r, off_t offset) {
+    if (r->chunk_size == 0 || offset < 0) {
+        fprintf(stderr, "Chunk at offset %lld outside the file\n", (long long)offset);
+        return -1;
+    }
+    long long index = offset / r->chunk_size;
+    if (index >= r->received_capacity) {
+        long long capacity = r->received_capacity ? r->received_capacity : 1024;
+        while (capacity <= index)
+            capacity *= 2;
+        unsigned char *received = realloc(r->received, capacity);
+        if (received == NULL) {
+            fprintf(stderr, "Error allocating buffer\n");
+            return -1;
+        }
+        r->received = received;
+        memset(r->received + r->received_capacity, 0, capacity - r->received_capacity);
+        r->received_capacity = capacity;
+    }
+    if (!r->received[index]) {
+        r->received[index] = TRUE;
+        r->received_chunks++;
+    }
+    return 0;
+}
+
+static int transfer_complete(bondReceiver *r) {
+    if (r->file_size < 0 || r->failed)
+        return FALSE;
+    return r->received_chunks >= (r->file_size + r->chunk_size - 1) / r->chunk_size;
+}
+
+static void *receive_link(void *arg) {
+    bondLink *bl = arg;
+    bondReceiver *r = bl->receiver;
+    unsigned char *packet = malloc(llmax_payload_link(bl->link));
+    double start = now_seconds();
+    int ended = FALSE;
+
+    while (!ended) {
+        int bytes_read = llread_link(bl->link, packet), value, length;
+        if (bytes_read < 1) {
+            fprintf(stderr, "Error receiving from link layer on %s\n", bl->parameters.serialPort);
+            break;
+        }
+        if (packet[0] == PACKET_START) {
+            pthread_mutex_lock(&r->lock);
+            if (start_received(r, packet, bytes_read) < 0)
+                r->failed = TRUE;
+            pthread_cond_broadcast(&r->changed);
+            int failed = r->failed;
+            pthread_mutex_unlock(&r->lock);
+            if (failed)
+                break;
+        } else if (packet[0] == PACKET_DATA && (value = find_field(packet, bytes_read, FIELD_OFFSET, &length)) >= 0) {
+            off_t offset = get_number(packet+value, length);
+            int data_size = bytes_read-value-length;
+            if (pwrite(r->file_desc, packet+value+length, data_size, offset) < 0) {
+                fprintf(stderr, "Error writing to file\n");
+                break;
+            }
+            bl->bytes += data_size;
+            pthread_mutex_lock(&r->lock);
+            if (chunk_received(r, offset) < 0)
+                r->failed = TRUE;
+            if (transfer_complete(r) || r->failed)
+                pthread_cond_broadcast(&r->changed);
+            int failed = r->failed;
+            pthread_mutex_unlock(&r->lock);
+            if (failed)
+                break;
+        } else if (packet[0] == PACKET_END) {
+            ended = TRUE;
+        }
+    }
+    bl->seconds = now_seconds() - start;
+    free(packet);
+
+    // Also after an error, so the port gets its settings back
+    llclose_link(bl->link, ended);
+    bl->link = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    r->running--;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+int bond_receive(linkLayer *links, int link_count, const char *file_path) {
+    static bondReceiver r; // static: threads blocked on dead links outlive this call
+    static bondLink bl[MAX_BONDED_LINKS];
+    pthread_t threads[MAX_BONDED_LINKS];
+    int timeout = 0;
+
+    memset(&r, 0, sizeof(r));
+    memset(bl, 0, sizeof(bl));
+    r.file_size = -1;
+    r.file_desc = open(file_path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (r.file_desc < 0) {
+        fprintf(stderr, "Error opening file: %s\n", file_path);
+        return -1;
+    }
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.changed, NULL);
+
+    for (int i = 0; i < link_count; i++) {
+        bl[i].parameters = links[i];
+        bl[i].receiver = &r;
+        bl[i].link = llopen_link(links[i]);
+        if (bl[i].link == NULL) {
+            fprintf(stderr, "Could not initialize link layer connection on %s\n", links[i].serialPort);
+            continue;
+        }
+        if (llmax_payload_link(bl[i].link) < BOND_START_SIZE) {
+            fprintf(stderr, "The payload of %s cannot carry a START packet of %d bytes\n", links[i].serialPort, BOND_START_SIZE);
+            llclose_link(bl[i].link, FALSE);
+            bl[i].link = NULL;
+            continue;
+        }
+        if (links[i].timeOut * (links[i].numTries + 1) > timeout)
+            timeout = links[i].timeOut * (links[i].numTries + 1);
+        r.running++;
+    }
+    if (r.running == 0) {
+        fprintf(stderr, "No link can carry chunks of the file\n");
+        close(r.file_desc);
+        return -1;
+    }
+    for (int i = 0; i < link_count; i++)
+        if (bl[i].link != NULL)
+            pthread_create(&threads[i], NULL, receive_link, &bl[i]);
+
+    /*
+     * llread() has no timeout, so a thread whose link died never returns.
+     * Once every chunk arrived, the links that are still closing get the time
+     * a DISC exchange can take before the threads left are abandoned
+     */
+    pthread_mutex_lock(&r.lock);
+    while (r.running > 0 && !transfer_complete(&r) && !r.failed)
+        pthread_cond_wait(&r.changed, &r.lock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    while (r.running > 0 && pthread_cond_timedwait(&r.changed, &r.lock, &deadline) != ETIMEDOUT)
+        ;
+    int complete = transfer_complete(&r);
+    int running = r.running;
+    pthread_mutex_unlock(&r.lock);
+
+    if (complete)
+        ftruncate(r.file_desc, r.file_size);
+    for (int i = 0; i < link_count; i++)
+        if (bl[i].bytes > 0)
+            printf("Link %s: %lld bytes in %.2f s (%.0f B/s)\n", bl[i].parameters.serialPort, bl[i].bytes, bl[i].seconds, bl[i].seconds > 0 ? bl[i].bytes / bl[i].seconds : 0);
+    printf("App layer: %s receiving file (%lld chunks)\n", complete ? "done" : "failed", r.received_chunks);
+    close(r.file_desc);
+
+    if (running == 0) {
+        free(r.received);
+        pthread_mutex_destroy(&r.lock);
+        pthread_cond_destroy(&r.changed);
+    }
+    return complete ? 0 : -1;
+}
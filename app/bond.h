@@ -0,0 +1,14 @@
+#ifndef BOND
+#define BOND
+
+#include "linklayer.h"
+
+//MAXIMUM number of serial ports that can be bonded together
+#define MAX_BONDED_LINKS 16
+
+// Sends the file striped over link_count links, one thread per link; returns 0 when every chunk was acknowledged
+int bond_send(linkLayer *links, int link_count, const char *file_path);
+// Receives a file striped over link_count links and writes every chunk at its offset; returns 0 when the whole file arrived
+int bond_receive(linkLayer *links, int link_count, const char *file_path);
+
+#endif
@@ -0,0 +1,169 @@
+#include "compress.h"
+#include <string.h>
+
+/*
+ * Chunks are a sequence of LZ4 style sequences:
+ * token (literal length << 4 | match length - 4), literal length extra bytes,
+ * literals, 16 bit offset (low byte first), match length extra bytes.
+ * A length nibble of 15 is followed by bytes that are added to it until one is not 255.
+ * The last sequence has only literals, it ends where the chunk ends
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET (LZ_WINDOW - 1)
+
+static unsigned int read32(const unsigned char *p) {
+    unsigned int value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hash(unsigned int sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Slides the buffer so size more bytes fit, keeping the last LZ_WINDOW bytes of history
+static void make_room(lzStream *stream, int size) {
+    if (stream->size + size <= LZ_BUFFER_SIZE)
+        return;
+    int shift = stream->size - LZ_WINDOW;
+    memmove(stream->buffer, stream->buffer + shift, LZ_WINDOW);
+    stream->size = LZ_WINDOW;
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        stream->table[i] = stream->table[i] >= shift ? stream->table[i] - shift : -1;
+}
+
+static int put_length(unsigned char *dst, int op, int dst_max, int length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= dst_max)
+            return -1;
+        dst[op++] = 255;
+    }
+    if (op >= dst_max)
+        return -1;
+    dst[op++] = length;
+    return op;
+}
+
+// Writes one sequence, match_length 0 for the last one; returns the new output size or -1 if dst_max is exceeded
+static int put_sequence(unsigned char *dst, int op, int dst_max, const unsigned char *literals, int literal_length, int offset, int match_length) {
+    int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    if (op >= dst_max)
+        return -1;
+    dst[op++] = (literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && (op = put_length(dst, op, dst_max, literal_length - 15)) < 0)
+        return -1;
+    if (literal_length > dst_max - op)
+        return -1;
+    memcpy(dst + op, literals, literal_length);
+    op += literal_length;
+    if (!match_length)
+        return op;
+    if (op + 2 > dst_max)
+        return -1;
+    dst[op++] = offset;
+    dst[op++] = offset >> 8;
+    if (match_code >= 15 && (op = put_length(dst, op, dst_max, match_code - 15)) < 0)
+        return -1;
+    return op;
+}
+
+// Reads the extra bytes of a length nibble of 15, returns -1 if the chunk ends first
+static int get_length(const unsigned char *src, int *ip, int size, int length) {
+    unsigned char byte;
+    if (length < 15)
+        return length;
+    do {
+        if (*ip >= size)
+            return -1;
+        byte = src[(*ip)++];
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+void lz_init(lzStream *stream) {
+    stream->size = 0;
+    memset(stream->table, 0xff, sizeof(stream->table));
+}
+
+int lz_compress(lzStream *stream, const unsigned char *src, int size, unsigned char *dst, int dst_max) {
+    if (size > LZ_WINDOW) {
+        lz_append(stream, src, size);
+        return -1;
+    }
+    make_room(stream, size);
+    unsigned char *base = stream->buffer;
+    int start = stream->size, end = start + size;
+    memcpy(base + start, src, size);
+    stream->size = end;
+
+    int ip = start, anchor = start, op = 0;
+    while (ip + LZ_MIN_MATCH <= end) {
+        unsigned int sequence = read32(base + ip);
+        int h = hash(sequence);
+        int ref = stream->table[h];
+        stream->table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(base + ref) != sequence) {
+            ip += 1 + ((ip - anchor) >> 6); // skip faster through data that does not compress
+            continue;
+        }
+        int length = LZ_MIN_MATCH;
+        while (ip + length < end && base[ref + length] == base[ip + length])
+            length++;
+        op = put_sequence(dst, op, dst_max, base + anchor, ip - anchor, ip - ref, length);
+        if (op < 0)
+            return -1;
+        ip += length;
+        anchor = ip;
+    }
+    return put_sequence(dst, op, dst_max, base + anchor, end - anchor, 0, 0);
+}
+
+int lz_decompress(lzStream *stream, const unsigned char *src, int size, unsigned char *dst, int dst_max) {
+    int limit = dst_max < LZ_WINDOW ? dst_max : LZ_WINDOW;
+    make_room(stream, limit);
+    unsigned char *base = stream->buffer;
+    int op = stream->size, end = op + limit, ip = 0;
+
+    while (ip < size) {
+        unsigned char token = src[ip++];
+        int literal_length = get_length(src, &ip, size, token >> 4);
+        if (literal_length < 0 || literal_length > size - ip || literal_length > end - op)
+            return -1;
+        memcpy(base + op, src + ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+        if (ip == size)
+            break;
+
+        if (ip + 2 > size)
+            return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        int match_length = get_length(src, &ip, size, token & 15);
+        if (match_length < 0 || offset == 0 || offset > op)
+            return -1;
+        match_length += LZ_MIN_MATCH;
+        if (match_length > end - op)
+            return -1;
+        for (int i = 0; i < match_length; i++) // byte by byte, the match may overlap its own output
+            base[op + i] = base[op - offset + i];
+        op += match_length;
+    }
+
+    int n = op - stream->size;
+    memcpy(dst, base + stream->size, n);
+    stream->size = op;
+    return n;
+}
+
+void lz_append(lzStream *stream, const unsigned char *src, int size) {
+    if (size > LZ_WINDOW) {
+        src += size - LZ_WINDOW;
+        size = LZ_WINDOW;
+    }
+    make_room(stream, size);
+    memcpy(stream->buffer + stream->size, src, size);
+    stream->size += size;
+}
@@ -0,0 +1,29 @@
+#ifndef COMPRESS
+#define COMPRESS
+
+//SIZE of the history matches can reach back into and of the largest chunk
+#define LZ_WINDOW 65536
+#define LZ_HASH_BITS 12
+#define LZ_BUFFER_SIZE (3 * LZ_WINDOW)
+
+/*
+ * LZ4 style streaming compression: every chunk can reference the last LZ_WINDOW
+ * bytes of the chunks before it, so both ends must see every chunk in the same order.
+ * Chunks sent uncompressed go through lz_append() on the receiver to keep the histories equal
+ */
+typedef struct lzStream {
+    unsigned char buffer[LZ_BUFFER_SIZE]; // history followed by the current chunk
+    int size;
+    int table[1 << LZ_HASH_BITS]; // compressor: last position of each hashed 4 byte sequence
+} lzStream;
+
+// Starts an empty history
+void lz_init(lzStream *stream);
+// Compresses size bytes of src (at most LZ_WINDOW) into dst, returns the compressed size or -1 if it is larger than dst_max
+int lz_compress(lzStream *stream, const unsigned char *src, int size, unsigned char *dst, int dst_max);
+// Decompresses a chunk made by lz_compress() into dst, returns its size or -1 if the chunk is corrupted or larger than dst_max
+int lz_decompress(lzStream *stream, const unsigned char *src, int size, unsigned char *dst, int dst_max);
+// Adds a chunk that was sent uncompressed to the history of the decompressor
+void lz_append(lzStream *stream, const unsigned char *src, int size);
+
+#endif
@@ -10,13 +10,31 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
+
+//SIZE of the application data exchanged in llopen(), see openData
+#define OPEN_DATA_MAX 24
 
 typedef struct linkLayer{
     char serialPort[50];
     int role; //defines the role of the program: 0==Transmitter, 1=Receiver
-    int baudRate;
+    int baudRate; //Bxxx constant or the rate itself, any rate the port accepts: 0==BAUDRATE_DEFAULT
+    int maxBaudRate; //fastest rate tried after SET/UA when both ends set it, stepping up from baudRate and keeping the last one that works: 0==off
     int numTries;
-    int timeOut;
+    int timeOut; //seconds without an answer before SET/DISC are sent again, and longest timeout of I frames, which adapts to the round trip
+    int windowSize; //number of I frames that can be sent before an acknowledgement is required: 1==Stop-and-Wait
+    int arqMode; //retransmission strategy used when windowSize>1: 0==Go-Back-N, 1==Selective Repeat
+    int fcs; //frame check sequence of I frames: 0==BCC2 (XOR), 1==CRC-16-CCITT, 2==CRC-32C; both ends use the strongest asked for
+    int maxPayload; //largest I frame payload proposed to the peer, up to MAX_PAYLOAD_LIMIT: 0==MAX_PAYLOAD_SIZE; both ends use the smallest
+    int fecParity; //Reed-Solomon parity bytes added to every 255 byte codeword of I frames, even and up to 32, corrects half as many wrong bytes: 0==off; both ends use the largest asked for
+    int adaptiveFrames; //llwrite() splits payloads into frames sized to the REJs and timeouts seen, llread() joins them again: 0==off; on if either end asks for it
+    int coalesceDelay; //ms llwrite() may hold payloads up to half a frame to send them together in one frame, llread() returns them one by one: 0==off
+    unsigned char openData[OPEN_DATA_MAX]; //bytes for the application at the other end, sent with SET/UA and read there with llpeer_data()
+    int openDataSize; //bytes of openData, up to OPEN_DATA_MAX: 0==none
+    int traceLevel; //events recorded in memory: 0==off, 1==frames, 2==every byte
+    char traceFile[100]; //file the recorded events are written to when the link is closed, decoded by bin/tracedump: ""==not written
+    int statsFormat; //format of statsFile: 0==JSON, 1==CSV
+    char statsFile[100]; //file the statistics are written to when the link is closed, JSON replaces it and CSV appends a row: ""==not written
 } linkLayer;
 
 //ROLE
@@ -24,14 +42,31 @@ typedef struct linkLayer{
 #define TRANSMITTER 0
 #define RECEIVER 1
 
+//ARQ MODE
+#define GO_BACK_N 0
+#define SELECTIVE_REPEAT 1
+
+//FRAME CHECK SEQUENCE
+#define FCS_BCC2 0
+#define FCS_CRC16 1
+#define FCS_CRC32C 2
+
+//STATISTICS FORMAT
+#define STATS_JSON 0
+#define STATS_CSV 1
+
 
 //SIZE of maximum acceptable payload; maximum number of bytes that application layer should send to link layer
+//unless a larger one was negotiated in llopen(), see llmax_payload()
 #define MAX_PAYLOAD_SIZE 1000
+#define MAX_PAYLOAD_LIMIT 65536
 
 //CONNECTION deafault values
 #define BAUDRATE_DEFAULT B38400
 #define MAX_RETRANSMISSIONS_DEFAULT 3
 #define TIMEOUT_DEFAULT 4
+#define WINDOW_SIZE_DEFAULT 1
+#define MAX_WINDOW_SIZE 7 // Go-Back-N limit with 3 bit sequence numbers, Selective Repeat is limited to 4
 #define _POSIX_SOURCE 1 /* POSIX compliant source */
 
 //MISC
@@ -40,11 +75,37 @@ typedef struct linkLayer{
 
 // Opens a connection using the "port" parameters defined in struct linkLayer, returns "-1" on error and "1" on sucess
 int llopen(linkLayer connectionParameters);
-// Sends data in buf with size bufSize
+// Sends data in buf with size bufSize; returns once the frame fits in the transmission window
 int llwrite(unsigned char* buf, int bufSize);
+// Same as llwrite() without copying the payload, gathered from iovcnt buffers that must stay unchanged until the frame is acknowledged
+int llwritev(const struct iovec *iov, int iovcnt);
 // Receive data in packet
 int llread(unsigned char* packet);
 // Closes previously opened connection; if showStatistics==TRUE, link layer should print statistics in the console on close
 int llclose(linkLayer connectionParameters, int showStatistics);
+// Largest payload llwrite() accepts and llread() can return, as agreed by both ends in llopen()
+int llmax_payload();
+// Copies the openData the peer sent in llopen() to data (up to OPEN_DATA_MAX bytes), returns how many bytes it sent: 0==none
+int llpeer_data(unsigned char *data);
+
+// Handle that owns the state of one link, so a process can drive many links at the same time
+typedef struct linkConnection linkConnection;
+
+// Same as llopen() but returns the handle of a new link, or NULL on error
+linkConnection *llopen_link(linkLayer connectionParameters);
+// Same as llwrite() on the given link
+int llwrite_link(linkConnection *link, unsigned char* buf, int bufSize);
+// Same as llwritev() on the given link
+int llwritev_link(linkConnection *link, const struct iovec *iov, int iovcnt);
+// Same as llread() on the given link
+int llread_link(linkConnection *link, unsigned char* packet);
+// Same as llmax_payload() on the given link
+int llmax_payload_link(linkConnection *link);
+// Same as llpeer_data() on the given link
+int llpeer_data_link(linkConnection *link, unsigned char *data);
+// Sends the payloads llwrite() holds and waits until every frame written to the link is acknowledged by the receiver, returns -1 if the link fails
+int llflush_link(linkConnection *link);
+// Same as llclose() on the given link, the handle is freed; links can be used from different threads, each link from one thread at a time
+int llclose_link(linkConnection *link, int showStatistics);
 
 #endif
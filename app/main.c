@@ -1,153 +1,768 @@
+#define _GNU_SOURCE // fallocate()
 #include "linklayer.h"
+#include "bond.h"
+#include "compress.h"
+#include "queue.h"
+#include "resume.h"
+#include "packet.h"
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <dirent.h>
 
 
 /*
- * $1 /dev/ttySxx
- * $2 tx | rx
- * $3 filename
+ * -w window size (1 == Stop-and-Wait)
+ * -s selective repeat instead of go-back-n
+ * -c crc16 | crc32c frame check sequence instead of BCC2
+ * -p largest payload per frame proposed to the peer (12 to 65536)
+ * -f Reed-Solomon parity bytes per 255 byte codeword, the receiver corrects up to half as many wrong bytes (up to 32)
+ * -a size the frames to the error rate of the line, splitting packets into smaller frames when it is noisy
+ * -n milliseconds small packets may wait to share a frame with the next ones (Nagle), 0 sends every packet in its own frame
+ * -z compress the file chunks (the receiver needs no option, each packet says whether it is compressed)
+ * -t file where the link layer trace is written on close (decoded by bin/tracedump)
+ * -v trace level: 0 off, 1 frames (default with -t), 2 every byte
+ * -o file where the link statistics are written on close (.csv appends a row, JSON otherwise)
+ * -b baud rate, any rate the port accepts (default 9600)
+ * -B fastest baud rate to step up to after the connection opens, when the peer sets it too
+ * -T seconds without an acknowledgement before frames are sent again (default 3)
+ * $1 /dev/ttySxx (or /dev/ttySxx,/dev/ttySyy,... to stripe the file over several ports, fd:<n> for a descriptor
+ *    inherited from the parent, mem | pipe | socketpair for loop)
+ * $2 tx | rx | loop (both ends in this process)
+ * $3 filename, tx takes several files and directories (their files) and sends them over one link;
+ *    rx writes them to a directory named here, under the names they were sent with
+ * $4 received filename (loop)
  */
 
-int main(int argc, char *argv[])
-{
-    if (argc < 4)
-    {
-        printf("usage: progname /dev/ttySxx tx|rx filename\n");
-        exit(1);
-    }
+#define PACKET_HEADERS 64 // headers of chunks sent from the mapping kept until their frames are acknowledged
 
-    printf("%s %s %s\n", argv[1], argv[2], argv[3]);
-    fflush(stdout);
+#define USAGE "usage: progname [-w window] [-s] [-c crc16|crc32c] [-p payload] [-f parity] [-a] [-n delay] [-z] [-t tracefile] [-v level] [-o stats.json|stats.csv] [-b baud] [-B max baud] [-T timeout] /dev/ttySxx tx|rx filename|directory...\n" \
+              "       progname [options] mem|pipe|socketpair loop filename received_filename\n"
 
-    if (strcmp(argv[2], "tx") == 0)
+typedef struct fileSender {
+    packetQueue queue;
+    lzStream *stream;
+    int file_desc;
+    int compress;
+    int chunk_size;
+    unsigned char *chunk; // file data read before it is compressed
+    unsigned char *map; // whole file, MAP_FAILED when it is read instead
+    off_t map_size;
+    off_t file_size; // -1 when it is not a regular file
+    unsigned char headers[PACKET_HEADERS][PACKET_HEADER_SIZE]; // llwritev() sends them from here, the queue slots are reused at once
+    int header_count;
+    off_t start; // where the file is resumed
+    long long file_bytes, sent_bytes;
+} fileSender;
+
+typedef struct fileReceiver {
+    packetQueue queue;
+    lzStream *stream;
+    int file_desc;
+    unsigned char *plain; // decompressed chunk
+    const char *file_path; // the file, or the directory the files are written to
+    int directory;
+    long long size; // from the start packet, -1 when the sender did not know it
+    int identified; // the sender identified the file, so progress is checkpointed
+    resumePoint point; // the file and the bytes written so far
+    long long checkpoint; // offset of the last checkpoint
+    int receiving; // a file started and did not end yet
+    int files; // files received whole
+    int done; // the sender closed the link after its last file
+} fileReceiver;
+
+// Reads and compresses the file into the queue, the end packet is the last one pushed
+static void *read_file(void *arg)
+{
+    fileSender *sender = arg;
+    off_t offset = sender->start;
+    for (;;)
     {
-        // ***********
-        // tx mode
-        printf("tx mode\n");
+        packetSlot *slot = queue_claim(&sender->queue);
+        if (slot == NULL)
+            break; // the link failed
+        int bytes_read;
+        const unsigned char *data;
+        if (sender->map != MAP_FAILED) {
+            data = sender->map + offset;
+            bytes_read = sender->map_size - offset < sender->chunk_size ? sender->map_size - offset : sender->chunk_size;
+        } else {
+            data = sender->compress ? sender->chunk : slot->packet+PACKET_HEADER_SIZE;
+            bytes_read = read(sender->file_desc, (void *)data, sender->chunk_size);
+        }
+        if (bytes_read < 0) {
+            fprintf(stderr, "Error reading file\n");
+            queue_close(&sender->queue);
+            break;
+        }
+        if (bytes_read == 0) {
+            // stop receiver
+            slot->packet[0] = PACKET_END;
+            slot->size = put_number(slot->packet, 1, FIELD_SIZE, offset);
+            queue_push(&sender->queue);
+            break;
+        }
+        int header_size = put_number(slot->packet, 1, FIELD_OFFSET, offset);
+        offset += bytes_read;
 
-        // open connection
-        struct linkLayer ll;
-        sprintf(ll.serialPort, "%s", argv[1]);
-        ll.role = 0;
-        ll.baudRate = 9600;
-        ll.numTries = 3;
-        ll.timeOut = 3;
+        // compressed only if it came out smaller
+        int packed_size = sender->compress ? lz_compress(sender->stream, data, bytes_read, slot->packet+header_size, bytes_read-1) : -1;
+        if (packed_size > 0) {
+            slot->packet[0] = PACKET_COMPRESSED;
+            slot->size = header_size+packed_size;
+        } else {
+            slot->packet[0] = PACKET_DATA;
+            packed_size = bytes_read;
+            slot->size = header_size;
+            if (sender->map != MAP_FAILED) {
+                slot->data = data;
+                slot->data_size = bytes_read;
+            } else {
+                if (data != slot->packet+header_size)
+                    memcpy(slot->packet+header_size, data, bytes_read);
+                slot->size += bytes_read;
+            }
+        }
+        sender->file_bytes += bytes_read;
+        sender->sent_bytes += packed_size;
+        queue_push(&sender->queue);
+    }
+    return NULL;
+}
 
-        if(llopen(ll)==-1) {
-            fprintf(stderr, "Could not initialize link layer connection\n");
-            exit(1);
+/*
+ * Starts the file of a start packet: the one given to rx, or the file of that name in its directory.
+ * The whole file is allocated up front, so the chunks fill it in place instead of growing it
+ */
+static int start_file(fileReceiver *receiver, const unsigned char *packet, int size)
+{
+    int value, length;
+    char name[256] = "";
+    receiver->size = -1;
+    if ((value = find_field(packet, size, FIELD_SIZE, &length)) >= 0)
+        receiver->size = get_number(packet+value, length);
+    if ((value = find_field(packet, size, FIELD_NAME, &length)) >= 0)
+        snprintf(name, sizeof(name), "%.*s", length, packet+value);
+    if (receiver->directory) {
+        if (name[0] == 0 || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            fprintf(stderr, "Cannot receive a file named %s\n", name);
+            return -1;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", receiver->file_path, name);
+        receiver->file_desc = open(path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        if (receiver->file_desc < 0) {
+            fprintf(stderr, "Error opening file: %s\n", path);
+            return -1;
         }
+        receiver->point.offset = 0;
+    } else if (receiver->files > 0 || receiver->receiving) {
+        fprintf(stderr, "The sender sends several files, receive them into a directory\n");
+        return -1;
+    }
+    if (receiver->size >= 0)
+        printf("App layer: receiving %s, %lld bytes\n", name, receiver->size);
+    else
+        printf("App layer: receiving %s\n", name);
+    if (receiver->size > 0 && fallocate(receiver->file_desc, 0, 0, receiver->size) < 0 && errno != EOPNOTSUPP)
+        perror("fallocate");
+    lz_init(receiver->stream); // every file is compressed on its own
+    receiver->receiving = TRUE;
+    return 0;
+}
 
-        printf("connection opened\n");
-        fflush(stdout);
-        fflush(stderr);
-
-        // open file to read
-        char *file_path = argv[3];
-        int file_desc = open(file_path, O_RDONLY);
-        if(file_desc < 0) {
-            fprintf(stderr, "Error opening file: %s\n", file_path);
-            exit(1);
-        }
-
-        // cycle through
-        const int buf_size = MAX_PAYLOAD_SIZE-1;
-        unsigned char buffer[buf_size+1];
-        int write_result = 0;
-        int bytes_read = 1;
-        while (bytes_read > 0)
-        {
-            bytes_read = read(file_desc, buffer+1, buf_size);
-            if(bytes_read < 0) {
-                    fprintf(stderr, "Error receiving from link layer\n");
-                    break;
+// Decompresses the packets of the queue and writes each chunk at its offset until the close packet
+static void *write_file(void *arg)
+{
+    fileReceiver *receiver = arg;
+    long long total_bytes = 0;
+    for (;;)
+    {
+        packetSlot *slot = queue_peek(&receiver->queue);
+        if (slot == NULL)
+            break;
+        unsigned char *packet = slot->packet;
+        int value, length;
+        if (packet[0] == PACKET_CLOSE) {
+            receiver->done = !receiver->receiving;
+            queue_pop(&receiver->queue);
+            break;
+        }
+        if (packet[0] == PACKET_START && start_file(receiver, packet, slot->size) < 0) {
+            queue_close(&receiver->queue);
+            break;
+        }
+        if (packet[0] == PACKET_END && receiver->receiving) {
+            // Trims what was allocated for a file that came out shorter
+            if ((value = find_field(packet, slot->size, FIELD_SIZE, &length)) >= 0 && ftruncate(receiver->file_desc, get_number(packet+value, length)) < 0) {
+                fprintf(stderr, "Error writing to file\n");
+                queue_close(&receiver->queue);
+                break;
             }
-            else if (bytes_read > 0) {
-                // continue sending data
-                buffer[0] = 1;
-                write_result = llwrite(buffer, bytes_read+1);
-                if(write_result < 0) {
-                    fprintf(stderr, "Error sending data to link layer\n");
+            printf("App layer: done receiving file\n");
+            if (receiver->directory) {
+                close(receiver->file_desc);
+                receiver->file_desc = -1;
+            }
+            receiver->receiving = FALSE;
+            receiver->files++;
+        }
+        if ((packet[0] == PACKET_DATA || packet[0] == PACKET_COMPRESSED) && receiver->receiving && (value = find_field(packet, slot->size, FIELD_OFFSET, &length)) >= 0) {
+            long long offset = get_number(packet+value, length);
+            unsigned char *data = packet+value+length;
+            int data_size = slot->size-value-length;
+            if (packet[0] == PACKET_COMPRESSED) {
+                data = receiver->plain;
+                data_size = lz_decompress(receiver->stream, packet+value+length, slot->size-value-length, receiver->plain, LZ_WINDOW);
+                if (data_size < 0) {
+                    fprintf(stderr, "Error decompressing data\n");
+                    queue_close(&receiver->queue);
                     break;
                 }
-                printf("read from file -> write to link layer, %d\n", bytes_read);
+            } else {
+                lz_append(receiver->stream, data, data_size); // chunks sent as they are are history of the next compressed ones
             }
-            else if (bytes_read == 0) {
-                // stop receiver
-                buffer[0] = 0;
-                llwrite(buffer, 1);
-                printf("App layer: done reading and sending file\n");
+            int write_result = pwrite(receiver->file_desc, data, data_size, offset);
+            if(write_result < 0) {
+                fprintf(stderr, "Error writing to file\n");
+                queue_close(&receiver->queue);
                 break;
             }
+            total_bytes = total_bytes + write_result;
+            if (offset == receiver->point.offset) // the checkpoint only covers the file up to the first gap
+                receiver->point.offset += write_result;
+            if (receiver->identified && receiver->point.offset - receiver->checkpoint >= RESUME_CHECKPOINT_BYTES) {
+                if (resume_save(receiver->file_path, receiver->file_desc, &receiver->point) < 0)
+                    perror("checkpoint");
+                receiver->checkpoint = receiver->point.offset;
+            }
+            printf("read from link layer -> write to file, %d %d %lld", slot->size, write_result, total_bytes);
+            if (receiver->size > 0)
+                printf(" (%lld%%)", 100 * (offset + write_result) / receiver->size);
+            printf("\n");
+        }
+        queue_pop(&receiver->queue);
+    }
+    return NULL;
+}
+
+// Fills one linkLayer per comma separated port, returns how many ports were given; bonded links trace and report to file.N
+static int parse_ports(char *ports, linkLayer ll, linkLayer *links)
+{
+    int count = 0;
+    for (char *port = strtok(ports, ","); port != NULL && count < MAX_BONDED_LINKS; port = strtok(NULL, ","))
+    {
+        links[count] = ll;
+        snprintf(links[count].serialPort, sizeof(links[count].serialPort), "%s", port);
+        if (ll.traceFile[0])
+            snprintf(links[count].traceFile, sizeof(links[count].traceFile), "%s.%d", ll.traceFile, count);
+        if (ll.statsFile[0])
+            snprintf(links[count].statsFile, sizeof(links[count].statsFile), "%s.%d", ll.statsFile, count);
+        count++;
+    }
+    return count;
+}
+
+// Opens and maps a file to send, returns -1 if it cannot be opened
+static int open_file(fileSender *sender, const char *file_path)
+{
+    memset(sender, 0, sizeof(fileSender));
+    sender->map = MAP_FAILED;
+    sender->file_size = -1;
+    sender->file_desc = open(file_path, O_RDONLY);
+    if (sender->file_desc < 0) {
+        fprintf(stderr, "Error opening file: %s\n", file_path);
+        return -1;
+    }
 
-            sleep(1);
+    // Chunks sent as they are go to the link layer straight from the mapping, without being copied
+    struct stat file_stat;
+    if (fstat(sender->file_desc, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        sender->file_size = file_stat.st_size;
+        if (file_stat.st_size > 0) {
+            sender->map_size = file_stat.st_size;
+            sender->map = mmap(NULL, sender->map_size, PROT_READ, MAP_PRIVATE, sender->file_desc, 0);
         }
-        // close connection
-        llclose(ll,1);
-        close(file_desc);
-        return 0;
     }
-    else
+    return 0;
+}
+
+static void close_file(fileSender *sender)
+{
+    if (sender->map != MAP_FAILED)
+        munmap(sender->map, sender->map_size);
+    close(sender->file_desc);
+}
+
+// Sends an open file over the link from sender->start, START to END; returns -1 if it could not be read or sent, then frames may still point at sender
+static int stream_file(linkConnection *link, fileSender *sender, const char *file_path, int compress)
+{
+    // frames are as large as both ends agreed on
+    sender->compress = compress;
+    sender->chunk_size = llmax_payload_link(link)-PACKET_HEADER_SIZE;
+    sender->chunk = malloc(sender->chunk_size);
+    sender->stream = malloc(sizeof(lzStream));
+    if(sender->chunk == NULL || sender->stream == NULL || queue_init(&sender->queue, llmax_payload_link(link)) < 0) {
+        fprintf(stderr, "Error allocating buffer\n");
+        exit(1);
+    }
+    lz_init(sender->stream);
+    if (sender->map != MAP_FAILED)
+        madvise(sender->map, sender->map_size, MADV_SEQUENTIAL);
+
+    // The start packet tells the receiver what to allocate, the name is cut to the room left in the payload
+    const char *name = strrchr(file_path, '/') != NULL ? strrchr(file_path, '/')+1 : file_path;
+    unsigned char start[PACKET_HEADER_SIZE + 2 + 255];
+    int start_size = 1;
+    start[0] = PACKET_START;
+    if (sender->file_size >= 0)
+        start_size = put_number(start, start_size, FIELD_SIZE, sender->file_size);
+    int name_length = strlen(name), room = llmax_payload_link(link) - start_size - 2;
+    if (name_length > 255)
+        name_length = 255;
+    if (name_length > room)
+        name_length = room;
+    if (name_length >= 0) { // the smallest payloads have no room for the name field at all
+        start[start_size] = FIELD_NAME;
+        start[start_size+1] = name_length;
+        memcpy(start+start_size+2, name, name_length);
+        start_size += 2+name_length;
+    }
+    int write_result = llwrite_link(link, start, start_size), done = FALSE;
+    if (write_result < 0) {
+        fprintf(stderr, "Error sending data to link layer\n");
+        queue_close(&sender->queue);
+    }
+
+    // The reader thread prepares the next chunks while this one keeps the link busy
+    pthread_t reader;
+    pthread_create(&reader, NULL, read_file, sender);
+    while (!done)
     {
-        // ***************
-        // rx mode
-        printf("rx mode\n");
+        packetSlot *slot = queue_peek(&sender->queue);
+        if (slot == NULL)
+            break;
+        done = slot->packet[0] == PACKET_END;
+        if (slot->data != NULL) {
+            // Once every header was used, the frames that point at the oldest one must be acknowledged before it is reused
+            unsigned char *header = sender->headers[sender->header_count++ % PACKET_HEADERS];
+            if (sender->header_count > PACKET_HEADERS && sender->header_count % PACKET_HEADERS == 1 && llflush_link(link) < 0)
+                write_result = -1;
+            memcpy(header, slot->packet, slot->size);
+            struct iovec iov[2] = {{header, slot->size}, {(void *)slot->data, slot->data_size}};
+            if (write_result >= 0)
+                write_result = llwritev_link(link, iov, 2);
+        } else {
+            write_result = llwrite_link(link, slot->packet, slot->size);
+        }
+        int size = slot->size+slot->data_size;
+        queue_pop(&sender->queue);
+        if(write_result < 0) {
+            fprintf(stderr, "Error sending data to link layer\n");
+            queue_close(&sender->queue);
+            done = FALSE;
+            break;
+        }
+        printf("read from file -> write to link layer, %d\n", size);
+    }
+    pthread_join(reader, NULL);
+    if (done)
+        printf("App layer: done reading and sending file, %lld bytes sent as %lld\n", sender->file_bytes, sender->sent_bytes);
 
-        struct linkLayer ll;
-        sprintf(ll.serialPort, "%s", argv[1]);
-        ll.role = 1;
-        ll.baudRate = 9600;
-        ll.numTries = 3;
-        ll.timeOut = 3;
+    // Every frame is acknowledged before the headers and the mapping go away, after a failure they stay until the link is closed
+    if (done && llflush_link(link) < 0) {
+        fprintf(stderr, "Error sending data to link layer\n");
+        done = FALSE;
+    }
+    queue_free(&sender->queue);
+    free(sender->chunk);
+    free(sender->stream);
+    return done ? 0 : -1;
+}
+static void add_file(char ***files, int *count, int *capacity, const char *path)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        *files = realloc(*files, *capacity * sizeof(char *));
+    }
+    if (*files == NULL || ((*files)[*count] = strdup(path)) == NULL) {
+        fprintf(stderr, "Error allocating buffer\n");
+        exit(1);
+    }
+    (*count)++;
+}
 
-        if(llopen(ll)==-1) {
-            fprintf(stderr, "Could not initialize link layer connection\n");
-            exit(1);
+// The files to send: the paths given, with directories replaced by the regular files in them; NULL if there are none
+static char **list_files(char *const *paths, int path_count, int *file_count)
+{
+    char **files = NULL;
+    int count = 0, capacity = 0;
+    for (int i = 0; i < path_count; i++)
+    {
+        struct stat path_stat;
+        if (stat(paths[i], &path_stat) < 0 || !S_ISDIR(path_stat.st_mode)) {
+            add_file(&files, &count, &capacity, paths[i]); // open_file() says why if it cannot be sent
+            continue;
+        }
+        struct dirent **entries;
+        int entry_count = scandir(paths[i], &entries, NULL, alphasort);
+        for (int j = 0; j < entry_count; j++)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", paths[i], entries[j]->d_name);
+            if (stat(path, &path_stat) == 0 && S_ISREG(path_stat.st_mode))
+                add_file(&files, &count, &capacity, path);
+            free(entries[j]);
         }
+        if (entry_count >= 0)
+            free(entries);
+    }
+    *file_count = count;
+    if (count == 0)
+        fprintf(stderr, "No files to send\n");
+    return files;
+}
+
+/*
+ * Sends the files one after the other over a new link, so the link is set up and closed once for all of them.
+ * A single file is resumed from where the receiver's checkpoint says; returns -1 if any file could not be sent
+ */
+static int send_files(linkLayer ll, char *const *paths, int path_count, int compress)
+{
+    int file_count;
+    char **files = list_files(paths, path_count, &file_count);
+    if (files == NULL)
+        return -1;
+
+    // Only a single mapped file can be identified, and so resumed
+    fileSender sender;
+    resumePoint identity, checkpoint;
+    int opened = file_count == 1 && open_file(&sender, files[0]) == 0;
+    if (opened && sender.map != MAP_FAILED) {
+        resume_identify(&identity, sender.map, sender.map_size);
+        resume_offer(&ll, &identity);
+    }
 
-        char *file_path = argv[3];
-        int file_desc = open(file_path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-        if(file_desc < 0) {
-            fprintf(stderr, "Error opening file: %s\n", file_path);
-            exit(1);
+    int result = 0;
+    linkConnection *link = llopen_link(ll);
+    if(link == NULL) {
+        fprintf(stderr, "Could not initialize link layer connection\n");
+        if (opened)
+            close_file(&sender);
+        result = -1;
+        file_count = 0;
+    } else {
+        printf("connection opened\n");
+        if (opened && sender.map != MAP_FAILED && resume_peer(link, &checkpoint) == 0 && (sender.start = resume_offset(&identity, &checkpoint)) > 0)
+            printf("resuming at byte %lld of %lld\n", (long long)sender.start, (long long)sender.map_size);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    // A file that cannot be opened is skipped, one that fails halfway stops the rest
+    int failed = FALSE;
+    for (int i = 0; i < file_count && !failed; i++)
+    {
+        if (!opened && open_file(&sender, files[i]) < 0) {
+            result = -1;
+            continue;
+        }
+        opened = FALSE;
+        failed = stream_file(link, &sender, files[i], compress) < 0;
+        if (!failed)
+            close_file(&sender);
+    }
+
+    // The file that failed stays open, llclose() may still send the frames that point at its mapping and headers
+    if (link != NULL) {
+        unsigned char close_packet = PACKET_CLOSE;
+        if (failed || llwrite_link(link, &close_packet, 1) < 0)
+            result = -1;
+        llclose_link(link, 1);
+    }
+    if (failed)
+        close_file(&sender);
+    for (int i = 0; i < file_count; i++)
+        free(files[i]);
+    free(files);
+    return result;
+}
+
+// Receives files over a new link, into a directory or one file that is resumed if the checkpoint is of it; returns -1 if they could not be received
+static int receive_file(linkLayer ll, const char *file_path)
+{
+    fileReceiver receiver = {0};
+    resumePoint checkpoint;
+    struct stat path_stat;
+    receiver.directory = stat(file_path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode);
+    int resumable = !receiver.directory && resume_load(file_path, &checkpoint) == 0;
+    ll.openDataSize = 0;
+    if (resumable)
+        resume_offer(&ll, &checkpoint);
+
+    linkConnection *link = llopen_link(ll);
+    if(link == NULL) {
+        fprintf(stderr, "Could not initialize link layer connection\n");
+        return -1;
+    }
+
+    // The file is cut where both ends start, whatever is after the checkpoint is sent again
+    receiver.identified = !receiver.directory && resume_peer(link, &receiver.point) == 0;
+    receiver.point.offset = receiver.identified && resumable ? resume_offset(&receiver.point, &checkpoint) : 0;
+    receiver.checkpoint = receiver.point.offset;
+    int file_desc = receiver.directory ? -1 : open(file_path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(!receiver.directory && (file_desc < 0 || ftruncate(file_desc, receiver.point.offset) < 0)) {
+        fprintf(stderr, "Error opening file: %s\n", file_path);
+        llclose_link(link, 0);
+        return -1;
+    }
+    if (receiver.point.offset > 0)
+        printf("resuming at byte %lld of %lld\n", receiver.point.offset, receiver.point.size);
+
+    receiver.file_desc = file_desc;
+    receiver.file_path = file_path;
+    receiver.size = -1;
+    receiver.plain = malloc(LZ_WINDOW);
+    receiver.stream = malloc(sizeof(lzStream));
+    if(receiver.plain == NULL || receiver.stream == NULL || queue_init(&receiver.queue, llmax_payload_link(link)) < 0) {
+        fprintf(stderr, "Error allocating buffer\n");
+        exit(1);
+    }
+    lz_init(receiver.stream);
+
+    // The writer thread takes disk writes and decompression off the llread() path
+    pthread_t writer;
+    pthread_create(&writer, NULL, write_file, &receiver);
+    int bytes_read = 0, done = FALSE;
+    while (!done)
+    {
+        packetSlot *slot = queue_claim(&receiver.queue);
+        if (slot == NULL)
+            break;
+        bytes_read = llread_link(link, slot->packet);
+        if(bytes_read < 0) {
+            fprintf(stderr, "Error receiving from link layer\n");
+            break;
+        }
+        else if (bytes_read > 0) {
+            done = slot->packet[0] == PACKET_CLOSE;
+            slot->size = bytes_read;
+            queue_push(&receiver.queue);
         }
+    }
+    queue_close(&receiver.queue);
+    pthread_join(writer, NULL);
+
+    // A complete file needs no checkpoint, an interrupted one keeps what was written
+    if (receiver.done && !receiver.directory)
+        resume_done(file_path);
+    else if (receiver.identified && resume_save(file_path, file_desc, &receiver.point) < 0)
+        perror("checkpoint");
+    if (receiver.directory)
+        printf("App layer: %d files received\n", receiver.files);
+
+    llclose_link(link, 1);
+    if (receiver.file_desc >= 0)
+        close(receiver.file_desc);
+    queue_free(&receiver.queue);
+    free(receiver.plain);
+    free(receiver.stream);
+    return receiver.done ? 0 : -1;
+}
+
+typedef struct loopReceiver {
+    linkLayer ll;
+    const char *file_path;
+    int result;
+} loopReceiver;
+
+static void *loop_receive(void *arg)
+{
+    loopReceiver *receiver = arg;
+    receiver->result = receive_file(receiver->ll, receiver->file_path);
+    return NULL;
+}
+
+/*
+ * Runs both ends of the link in this process over in-process queues (mem), a pair of pipes
+ * or a socketpair, without a serial port or the cable; the receiver traces and reports to file.rx
+ */
+static int loop_transfer(linkLayer ll, const char *kind, const char *file_path, const char *received_path, int compress)
+{
+    loopReceiver receiver = {ll, received_path, 0};
+    receiver.ll.role = RECEIVER;
+    if (ll.traceFile[0])
+        snprintf(receiver.ll.traceFile, sizeof(receiver.ll.traceFile), "%s.rx", ll.traceFile);
+    if (ll.statsFile[0])
+        snprintf(receiver.ll.statsFile, sizeof(receiver.ll.statsFile), "%s.rx", ll.statsFile);
+
+    int fds[4] = {-1, -1, -1, -1};
+    if (strcmp(kind, "mem") == 0) {
+        snprintf(ll.serialPort, sizeof(ll.serialPort), "mem:loop");
+        snprintf(receiver.ll.serialPort, sizeof(receiver.ll.serialPort), "mem:loop");
+    } else if (strcmp(kind, "pipe") == 0) {
+        if (pipe(fds) < 0 || pipe(fds+2) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        snprintf(ll.serialPort, sizeof(ll.serialPort), "fd:%d,%d", fds[2], fds[1]);
+        snprintf(receiver.ll.serialPort, sizeof(receiver.ll.serialPort), "fd:%d,%d", fds[0], fds[3]);
+    } else if (strcmp(kind, "socketpair") == 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return -1;
+        }
+        snprintf(ll.serialPort, sizeof(ll.serialPort), "fd:%d", fds[0]);
+        snprintf(receiver.ll.serialPort, sizeof(receiver.ll.serialPort), "fd:%d", fds[1]);
+    } else {
+        fprintf(stderr, "loop runs over mem, pipe or socketpair, not %s\n", kind);
+        return -1;
+    }
 
-        int bytes_read = 0;
-        int write_result = 0;
-        const int buf_size = MAX_PAYLOAD_SIZE;
-        unsigned char buffer[buf_size];
-        int total_bytes = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, loop_receive, &receiver);
+    char *const paths[1] = {(char *)file_path};
+    int result = send_files(ll, paths, 1, compress);
+    pthread_join(thread, NULL);
+    for (int i = 0; i < 4; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    return result < 0 || receiver.result < 0 ? -1 : 0;
+}
 
-        while (bytes_read >= 0)
+int main(int argc, char *argv[])
+{
+    int opt, window_size = 1, arq_mode = GO_BACK_N, fcs = FCS_BCC2, max_payload = MAX_PAYLOAD_SIZE, fec_parity = 0, adaptive_frames = FALSE, coalesce_delay = 0, compress = FALSE, trace_level = -1, baud_rate = 9600, max_baud_rate = 0, time_out = 3;
+    char *trace_file = "", *stats_file = "";
+    while ((opt = getopt(argc, argv, "w:sc:p:f:an:zt:v:o:b:B:T:")) != -1)
+    {
+        switch (opt)
         {
-            bytes_read = llread(buffer);
-            if(bytes_read < 0) {
-                fprintf(stderr, "Error receiving from link layer\n");
+            case 'w':
+                window_size = atoi(optarg);
                 break;
-            }
-            else if (bytes_read > 0) {
-                if (buffer[0] == 1) {
-                    write_result = write(file_desc, buffer+1, bytes_read-1);
-                    if(write_result < 0) {
-                        fprintf(stderr, "Error writing to file\n");
-                        break;
-                    }
-                    total_bytes = total_bytes + write_result;
-                    printf("read from file -> write to link layer, %d %d %d\n", bytes_read, write_result, total_bytes);
-                }
-                else if (buffer[0] == 0) {
-                    printf("App layer: done receiving file\n");
-                    break;
-                }
-            }
+            case 's':
+                arq_mode = SELECTIVE_REPEAT;
+                break;
+            case 'c':
+                fcs = strcmp(optarg, "crc32c") == 0 ? FCS_CRC32C : strcmp(optarg, "crc16") == 0 ? FCS_CRC16 : FCS_BCC2;
+                break;
+            case 'p':
+                max_payload = atoi(optarg);
+                break;
+            case 'f':
+                fec_parity = atoi(optarg);
+                break;
+            case 'a':
+                adaptive_frames = TRUE;
+                break;
+            case 'n':
+                coalesce_delay = atoi(optarg);
+                break;
+            case 'z':
+                compress = TRUE;
+                break;
+            case 't':
+                trace_file = optarg;
+                break;
+            case 'v':
+                trace_level = atoi(optarg);
+                break;
+            case 'o':
+                stats_file = optarg;
+                break;
+            case 'b':
+                baud_rate = atoi(optarg);
+                break;
+            case 'B':
+                max_baud_rate = atoi(optarg);
+                break;
+            case 'T':
+                time_out = atoi(optarg);
+                break;
+            default:
+                printf("%s", USAGE);
+                exit(1);
         }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (trace_level < 0)
+        trace_level = trace_file[0] ? 1 : 0;
+    if (max_payload < PACKET_HEADER_SIZE + 1) {
+        fprintf(stderr, "The payload must fit a data packet header and a byte of the file, at least %d bytes\n", PACKET_HEADER_SIZE + 1);
+        exit(1);
+    }
+    size_t stats_length = strlen(stats_file);
+    int stats_format = stats_length >= 4 && strcmp(stats_file + stats_length - 4, ".csv") == 0 ? STATS_CSV : STATS_JSON;
 
-        llclose(ll,1);
-        close(file_desc);
-        return 0;
+    if (argc < 4 || (strcmp(argv[2], "loop") == 0 && argc < 5))
+    {
+        printf("%s", USAGE);
+        exit(1);
+    }
+
+    printf("%s %s %s\n", argv[1], argv[2], argv[3]);
+    fflush(stdout);
+
+    struct linkLayer ll;
+    sprintf(ll.serialPort, "%s", argv[1]);
+    ll.role = strcmp(argv[2], "rx") == 0 ? RECEIVER : TRANSMITTER;
+    ll.baudRate = baud_rate;
+    ll.maxBaudRate = max_baud_rate;
+    ll.numTries = 3;
+    ll.timeOut = time_out;
+    ll.windowSize = window_size;
+    ll.arqMode = arq_mode;
+    ll.fcs = fcs;
+    ll.maxPayload = max_payload;
+    ll.openDataSize = 0;
+    ll.fecParity = fec_parity;
+    ll.adaptiveFrames = adaptive_frames;
+    ll.coalesceDelay = coalesce_delay;
+    ll.traceLevel = trace_level;
+    snprintf(ll.traceFile, sizeof(ll.traceFile), "%s", trace_file);
+    ll.statsFormat = stats_format;
+    snprintf(ll.statsFile, sizeof(ll.statsFile), "%s", stats_file);
+
+    if (strcmp(argv[2], "loop") == 0)
+        return loop_transfer(ll, argv[1], argv[3], argv[4], compress) < 0 ? 1 : 0;
+
+    linkLayer links[MAX_BONDED_LINKS];
+    int link_count = parse_ports(argv[1], ll, links);
+
+    // Bonded links stripe a single file as it is, from its first byte
+    resumePoint checkpoint;
+    if (link_count > 1 && ll.role == TRANSMITTER && (compress || argc > 4)) {
+        fprintf(stderr, "Bonded links send a single file and do not compress it\n");
+        return 1;
+    }
+    if (link_count > 1 && ll.role == RECEIVER && resume_load(argv[3], &checkpoint) == 0) {
+        fprintf(stderr, "%s was interrupted, bonded links cannot resume it: receive it over a single link\n", argv[3]);
+        return 1;
+    }
+
+    if (strcmp(argv[2], "tx") == 0)
+    {
+        // ***********
+        // tx mode
+        printf("tx mode\n");
+        if (link_count > 1)
+            return bond_send(links, link_count, argv[3]) < 0 ? 1 : 0;
+        return send_files(ll, argv+3, argc-3, compress) < 0 ? 1 : 0;
+    }
+    else
+    {
+        // ***************
+        // rx mode
+        printf("rx mode\n");
+        if (link_count > 1)
+            return bond_receive(links, link_count, argv[3]) < 0 ? 1 : 0;
+        return receive_file(ll, argv[3]) < 0 ? 1 : 0;
     }
 }
@@ -0,0 +1,29 @@
+#include "packet.h"
+
+int put_number(unsigned char *packet, int size, unsigned char type, unsigned long long value)
+{
+    packet[size] = type;
+    packet[size+1] = NUMBER_SIZE;
+    for (int i = 0; i < NUMBER_SIZE; i++)
+        packet[size+2+i] = value >> (8 * (NUMBER_SIZE - 1 - i));
+    return size + 2 + NUMBER_SIZE;
+}
+
+long long get_number(const unsigned char *value, int length)
+{
+    unsigned long long number = 0;
+    for (int i = 0; i < length; i++)
+        number = (number << 8) | value[i];
+    return number;
+}
+
+int find_field(const unsigned char *packet, int size, unsigned char type, int *length)
+{
+    for (int i = 1; i + 2 <= size && i + 2 + packet[i+1] <= size; i += 2 + packet[i+1]) {
+        if (packet[i] == type) {
+            *length = packet[i+1];
+            return i + 2;
+        }
+    }
+    return -1;
+}
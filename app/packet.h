@@ -0,0 +1,30 @@
+#ifndef PACKET
+#define PACKET
+
+/*
+ * First byte of every packet, followed by fields: type, length and value, numbers high byte first.
+ * Data packets end with the chunk, which takes the rest of the packet after the offset field.
+ * A single link and bonded links send a file the same way: START, DATA in any order, then END
+ */
+#define PACKET_END 0 // FIELD_SIZE: bytes sent, the file ends there
+#define PACKET_DATA 1 // FIELD_OFFSET of the chunk in the file, then the chunk
+#define PACKET_START 2 // FIELD_SIZE of the file when it has one, FIELD_CHUNK over bonded links, FIELD_NAME
+#define PACKET_COMPRESSED 3 // as PACKET_DATA, with the chunk compressed with the history of the chunks before it
+#define PACKET_CLOSE 4 // no more files, the link closes
+
+#define FIELD_SIZE 0
+#define FIELD_NAME 1
+#define FIELD_OFFSET 2
+#define FIELD_CHUNK 3 // bytes of every chunk but the last one, so each end of a bonded transfer counts the same chunks
+
+#define NUMBER_SIZE 8 // bytes of a number field, fixed so every data packet has the same header
+#define PACKET_HEADER_SIZE (1 + 2 + NUMBER_SIZE) // type and offset field of a data packet
+
+// Appends a number field to the packet of size bytes, returns the new size
+int put_number(unsigned char *packet, int size, unsigned char type, unsigned long long value);
+// Value of a number field of length bytes
+long long get_number(const unsigned char *value, int length);
+// Finds the first field of this type after the packet type, returns where its value starts or -1, its length in *length
+int find_field(const unsigned char *packet, int size, unsigned char type, int *length);
+
+#endif
@@ -0,0 +1,67 @@
+#include "queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+int queue_init(packetQueue *queue, int capacity) {
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    for (int i = 0; i < QUEUE_SLOTS; i++) {
+        queue->slots[i].packet = malloc(capacity);
+        if (queue->slots[i].packet == NULL) {
+            queue_free(queue);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+packetSlot *queue_claim(packetQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->closed && queue->head - queue->tail == QUEUE_SLOTS)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    packetSlot *slot = queue->closed ? NULL : &queue->slots[queue->head % QUEUE_SLOTS];
+    pthread_mutex_unlock(&queue->lock);
+    if (slot != NULL) {
+        slot->data = NULL;
+        slot->data_size = 0;
+    }
+    return slot;
+}
+
+void queue_push(packetQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->head++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+packetSlot *queue_peek(packetQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->closed && queue->head == queue->tail)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    packetSlot *slot = queue->head == queue->tail ? NULL : &queue->slots[queue->tail % QUEUE_SLOTS];
+    pthread_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+void queue_pop(packetQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->tail++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_close(packetQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_free(packetQueue *queue) {
+    for (int i = 0; i < QUEUE_SLOTS; i++)
+        free(queue->slots[i].packet);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
@@ -0,0 +1,44 @@
+#ifndef QUEUE
+#define QUEUE
+
+#include <pthread.h>
+
+//NUMBER of packets that can wait between the file thread and the link thread
+#define QUEUE_SLOTS 8
+
+typedef struct packetSlot {
+    unsigned char *packet; // owned buffer, queue capacity bytes
+    int size;
+    const unsigned char *data; // payload kept outside packet (zero copy), sent after the size bytes of packet
+    int data_size;
+} packetSlot;
+
+/*
+ * Bounded queue of packets between one producer and one consumer thread.
+ * The producer claims a free slot, fills it and pushes it; the consumer peeks the
+ * oldest one and pops it once it is done with it, so slots are reused without copies
+ */
+typedef struct packetQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    packetSlot slots[QUEUE_SLOTS];
+    unsigned int head, tail; // free running counters
+    int closed;
+} packetQueue;
+
+// Allocates every slot with capacity bytes, returns -1 if there is not enough memory
+int queue_init(packetQueue *queue, int capacity);
+// Waits for a free slot, returns NULL once the queue is closed
+packetSlot *queue_claim(packetQueue *queue);
+// Hands the claimed slot to the consumer
+void queue_push(packetQueue *queue);
+// Waits for the oldest slot pushed, returns NULL once the queue is closed and empty
+packetSlot *queue_peek(packetQueue *queue);
+// Gives the peeked slot back to the producer
+void queue_pop(packetQueue *queue);
+// No more slots are pushed; a producer blocked in queue_claim() gives up
+void queue_close(packetQueue *queue);
+// Releases the slots, both threads must be done with the queue
+void queue_free(packetQueue *queue);
+
+#endif
@@ -0,0 +1,94 @@
+#include "resume.h"
+#include "../protocol/crc.h"
+#include <limits.h>
+
+static void put_value(unsigned char *buf, unsigned long long value, int size) {
+    for (int i = 0; i < size; i++)
+        buf[i] = value >> (8 * (size - 1 - i));
+}
+
+static unsigned long long get_value(const unsigned char *buf, int size) {
+    unsigned long long value = 0;
+    for (int i = 0; i < size; i++)
+        value = (value << 8) | buf[i];
+    return value;
+}
+
+static void checkpoint_path(char *path, int path_size, const char *file_path) {
+    snprintf(path, path_size, "%s.resume", file_path);
+}
+
+void resume_identify(resumePoint *point, const unsigned char *map, long long size) {
+    unsigned int crc = 0;
+    for (long long done = 0; done < size; ) {
+        int chunk = size - done < INT_MAX / 2 ? size - done : INT_MAX / 2;
+        crc = crc32c_update(crc, map + done, chunk);
+        done += chunk;
+    }
+    point->size = size;
+    point->crc = crc;
+    point->offset = 0;
+}
+
+void resume_offer(linkLayer *ll, const resumePoint *point) {
+    put_value(ll->openData, point->size, 8);
+    put_value(ll->openData + 8, point->crc, 4);
+    put_value(ll->openData + 12, point->offset, 8);
+    ll->openDataSize = RESUME_DATA_SIZE;
+}
+
+int resume_peer(linkConnection *link, resumePoint *point) {
+    unsigned char data[OPEN_DATA_MAX];
+    if (llpeer_data_link(link, data) != RESUME_DATA_SIZE)
+        return -1;
+    point->size = get_value(data, 8);
+    point->crc = get_value(data + 8, 4);
+    point->offset = get_value(data + 12, 8);
+    return 0;
+}
+
+long long resume_offset(const resumePoint *sent, const resumePoint *checkpoint) {
+    if (sent->size != checkpoint->size || sent->crc != checkpoint->crc)
+        return 0;
+    return checkpoint->offset >= 0 && checkpoint->offset <= sent->size ? checkpoint->offset : 0;
+}
+
+int resume_load(const char *file_path, resumePoint *point) {
+    char path[PATH_MAX];
+    checkpoint_path(path, sizeof(path), file_path);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    int fields = fscanf(file, "%lld %x %lld", &point->size, &point->crc, &point->offset);
+    fclose(file);
+    struct stat file_stat;
+    if (fields != 3 || stat(file_path, &file_stat) < 0 || file_stat.st_size < point->offset)
+        return -1;
+    return 0;
+}
+
+// The data reaches the disk before the checkpoint that counts it, which replaces the old one in a single rename
+int resume_save(const char *file_path, int file_desc, const resumePoint *point) {
+    char path[PATH_MAX], temporary[PATH_MAX + 4];
+    checkpoint_path(path, sizeof(path), file_path);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    if (fdatasync(file_desc) < 0)
+        return -1;
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL)
+        return -1;
+    fprintf(file, "%lld %08x %lld\n", point->size, point->crc, point->offset);
+    if (fflush(file) != 0 || fdatasync(fileno(file)) < 0) {
+        fclose(file);
+        return -1;
+    }
+    if (fclose(file) != 0 || rename(temporary, path) < 0)
+        return -1;
+    return 0;
+}
+
+void resume_done(const char *file_path) {
+    char path[PATH_MAX];
+    checkpoint_path(path, sizeof(path), file_path);
+    unlink(path);
+}
@@ -0,0 +1,39 @@
+#ifndef RESUME
+#define RESUME
+
+#include "linklayer.h"
+
+/*
+ * Resumable transfers: the receiver keeps a checkpoint next to the file it writes (file.resume)
+ * with the identity of the file being sent, its size and CRC-32C, and the offset up to which
+ * the data is written and synced to disk.
+ * Both ends give theirs to llopen() as openData, the sender its identity and the receiver its
+ * checkpoint, and both start at the checkpoint when the identities match, or at 0 otherwise
+ */
+
+// Bytes received between two checkpoints
+#define RESUME_CHECKPOINT_BYTES (1 << 20)
+#define RESUME_DATA_SIZE 20 // size, CRC and offset in openData, high byte first
+
+typedef struct resumePoint {
+    long long size; // bytes of the file
+    unsigned int crc; // CRC-32C of the whole file
+    long long offset; // bytes the receiver has, 0 in the sender's
+} resumePoint;
+
+// Identity of the file of size bytes mapped at map
+void resume_identify(resumePoint *point, const unsigned char *map, long long size);
+// Sends point to the peer in llopen()
+void resume_offer(linkLayer *ll, const resumePoint *point);
+// Reads the point the peer sent in llopen(), returns -1 if it sent none
+int resume_peer(linkConnection *link, resumePoint *point);
+// Offset both ends start at: the checkpoint's if it is of the file identified by sent
+long long resume_offset(const resumePoint *sent, const resumePoint *checkpoint);
+// Reads the checkpoint of file_path, returns -1 if there is none or the file is shorter than it says
+int resume_load(const char *file_path, resumePoint *point);
+// Syncs the data written to file_desc and makes point the checkpoint of file_path, returns -1 on error
+int resume_save(const char *file_path, int file_desc, const resumePoint *point);
+// Removes the checkpoint of a complete file
+void resume_done(const char *file_path);
+
+#endif
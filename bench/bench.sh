@@ -0,0 +1,109 @@
+#!/bin/bash
+
+# Sends generated files over the emulated cable for every combination of the settings below
+# and appends one CSV row per configuration to $1 (default bench.csv)
+#
+# Every list can be overridden from the environment, e.g.
+#   SIZES="1K 1M" BAUDS=115200 BERS="0 1e-5" ./bench/bench.sh results.csv
+# BAUDS of 0 let the cable forward at pty speed, main gets no -b and their efficiency column
+# stays empty; configurations expected to take longer than MAX_SECONDS on the line are skipped,
+# so the largest files only run unthrottled.
+# The cable needs socat and permission to create /dev/ttyS10 and /dev/ttyS11.
+
+SIZES=${SIZES:-"1K 64K 1M 16M 256M"}
+PAYLOADS=${PAYLOADS:-"256 1000 8192"}
+BAUDS=${BAUDS:-"115200 921600 0"}
+BERS=${BERS:-"0 1e-5"}
+TIMEOUTS=${TIMEOUTS:-"1 3"}
+WINDOW=${WINDOW:-4}
+OPTIONS=${OPTIONS:-""} # more options for both ends, e.g. "-c crc32c -s"
+DELAY=${DELAY:-0} # one way propagation delay, ms
+SEED=${SEED:-1}
+MAX_SECONDS=${MAX_SECONDS:-60}
+TRANSFER_TIMEOUT=${TRANSFER_TIMEOUT:-600}
+
+OUTPUT=${1:-bench.csv}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cd "$(dirname "$0")/.."
+
+bytes() {
+    numfmt --from=iec "$1"
+}
+
+# Column of the last row of a CSV written by the link layer (-o)
+column_of() {
+    awk -F, -v name="$2" 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == name) column = i } END { print $column }' "$1"
+}
+
+start_cable() {
+    rm -f "$WORK/cable.in"
+    mkfifo "$WORK/cable.in"
+    stdbuf -oL ./bin/cable -b "$1" -e "$2" -l "$DELAY" -s "$SEED" < "$WORK/cable.in" > "$WORK/cable.log" 2>&1 &
+    exec 3> "$WORK/cable.in"
+    for i in $(seq 100); do
+        grep -q "^cable" "$WORK/cable.log" 2>/dev/null && break
+        sleep 0.1
+    done
+    sleep 0.2 # the receiving end of the cable opens right after
+}
+
+stop_cable() {
+    echo end >&3
+    exec 3>&-
+    wait
+}
+
+if [ ! -s "$OUTPUT" ]; then
+    echo "version,size,payload,baud,ber,timeout,window,options,ok,elapsed_s,goodput_bps,efficiency,transmitted_frames,retransmitted_frames,retransmission_ratio,timeouts,tx_cpu_s,rx_cpu_s" > "$OUTPUT"
+fi
+VERSION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+for size in $SIZES; do
+    head -c "$(bytes "$size")" /dev/urandom > "$WORK/file"
+    for baud in $BAUDS; do
+        if [ "$baud" -gt 0 ] && [ $(( $(bytes "$size") * 10 / baud )) -gt "$MAX_SECONDS" ]; then
+            echo "skipping $size at $baud baud"
+            continue
+        fi
+        for payload in $PAYLOADS; do
+            for ber in $BERS; do
+                for timeout in $TIMEOUTS; do
+                    start_cable "$baud" "$ber"
+                    rm -f "$WORK/received" "$WORK/tx.csv"
+                    options="-w $WINDOW -p $payload -T $timeout $OPTIONS"
+                    if [ "$baud" -gt 0 ]; then
+                        options="-b $baud $options"
+                    fi
+                    TIMEFORMAT="%U %S"
+
+                    { time timeout "$TRANSFER_TIMEOUT" ./bin/main $options /dev/ttyS11 rx "$WORK/received" > /dev/null 2>&1 ; } 2> "$WORK/rx.time" &
+                    receiver=$!
+                    sleep 0.2
+                    { time timeout "$TRANSFER_TIMEOUT" ./bin/main $options -o "$WORK/tx.csv" /dev/ttyS10 tx "$WORK/file" > /dev/null 2>&1 ; } 2> "$WORK/tx.time"
+                    wait $receiver
+                    stop_cable
+
+                    ok=0
+                    cmp -s "$WORK/file" "$WORK/received" && ok=1
+                    tx_cpu=$(awk '{ print $1 + $2 }' "$WORK/tx.time")
+                    rx_cpu=$(awk '{ print $1 + $2 }' "$WORK/rx.time")
+                    row="$VERSION,$size,$payload,$baud,$ber,$timeout,$WINDOW,$OPTIONS,$ok"
+                    if [ -s "$WORK/tx.csv" ]; then
+                        for column in elapsed_s goodput_bps efficiency transmitted_frames retransmitted_frames retransmission_ratio timeouts; do
+                            value=$(column_of "$WORK/tx.csv" $column)
+                            if [ "$column" = efficiency ] && [ "$baud" -eq 0 ]; then
+                                value="" # against the default rate of main, not a line the pty has
+                            fi
+                            row="$row,$value"
+                        done
+                    else
+                        row="$row,,,,,,,"
+                    fi
+                    echo "$row,$tx_cpu,$rx_cpu" | tee -a "$OUTPUT"
+                done
+            done
+        done
+    done
+done
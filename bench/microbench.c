@@ -0,0 +1,343 @@
+/*
+ * Microbenchmarks of the per byte code of the link layer over buffers in memory:
+ * the stuffing kernels (which also fold the BCC2), the clean run scan of llwritev, the CRCs, the FEC codec,
+ * and llwrite/llread with their state machines, fed from a file that holds the peer's frames
+ *
+ * usage: microbench [-s bytes] [file...]   (penguin.gif when no file is given)
+ */
+
+#include "../protocol/linklayer.h"
+#include "../protocol/stuffing.h"
+#include "../protocol/crc.h"
+#include "../protocol/fec.h"
+#include "../protocol/stats.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DATA_SIZE (1 << 20) // bytes of each data set
+#define CHUNK MAX_PAYLOAD_SIZE // bytes per call, like the payload of a frame
+#define MIN_TIME 200000000ULL // ns each routine runs for at least
+#define FEC_PARITY 16 // parity bytes of the FEC codewords
+
+// Frame bytes of the peer, see linklayer.c
+#define A_TX 0x01
+#define SET 0x07
+#define UA 0x06
+#define DISC 0x0a
+#define I_CTRL(n) (0x80 | ((n) << 6))
+#define RR_CTRL(n) (0x01 | ((n) << 4))
+
+static volatile unsigned int sink; // keeps the results alive
+
+typedef struct timer {
+    uint64_t ns, cycles;
+} timer;
+
+// Time stamp counter, 0 where there is none
+static uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void timer_start(timer *t) {
+    t->cycles = now_cycles();
+    t->ns = now_ns();
+}
+
+static uint64_t timer_elapsed(timer *t) {
+    return now_ns() - t->ns;
+}
+
+static void report(const char *data, const char *routine, const char *kernel, long long bytes, timer *t) {
+    uint64_t cycles = now_cycles() - t->cycles, ns = now_ns() - t->ns;
+    printf("%-14s %-10s %-7s %10.3f %12.3f %10.1f\n", data, routine, kernel, (double)ns / bytes,
+        now_cycles() ? (double)cycles / bytes : 0, bytes / (ns / 1e9) / 1e6);
+}
+
+static const char *kernel_name(int kernel) {
+    return kernel == STUFFING_AVX2 ? "avx2" : kernel == STUFFING_SSE2 ? "sse2" : "scalar";
+}
+
+static void bench_stuff(const char *name, const unsigned char *data, int size, const char *kernel) {
+    unsigned char frame[2*CHUNK];
+    long long bytes = 0;
+    timer t;
+    timer_start(&t);
+    do {
+        for(int i = 0; i < size; i += CHUNK) {
+            unsigned char bcc2 = 0;
+            int escaped = 0, chunk = size - i < CHUNK ? size - i : CHUNK;
+            sink += stuff(data + i,chunk,frame,&bcc2,&escaped) + bcc2;
+        }
+        bytes += size;
+    } while(timer_elapsed(&t) < MIN_TIME);
+    report(name,"stuff",kernel,bytes,&t);
+}
+
+// The scan llwritev() does to find the bytes it can send from the caller's buffer
+static void bench_clean_run(const char *name, const unsigned char *data, int size, const char *kernel) {
+    long long bytes = 0;
+    timer t;
+    timer_start(&t);
+    do {
+        unsigned char bcc2 = 0;
+        for(int i = 0; i < size; i++) {
+            i += clean_run(data + i,size - i,&bcc2);
+            if(i < size)
+                bcc2 ^= data[i];
+        }
+        sink += bcc2;
+        bytes += size;
+    } while(timer_elapsed(&t) < MIN_TIME);
+    report(name,"clean_run",kernel,bytes,&t);
+}
+
+static void bench_destuff(const char *name, const unsigned char *frames, int frames_size, int size, const char *kernel) {
+    unsigned char payload[CHUNK + 1];
+    long long bytes = 0;
+    timer t;
+    timer_start(&t);
+    do {
+        for(int i = 0; i < frames_size;) {
+            destuffState state = {0};
+            i += destuff(frames + i,frames_size - i,payload,sizeof(payload),&state);
+            sink += state.bcc;
+        }
+        bytes += size;
+    } while(timer_elapsed(&t) < MIN_TIME);
+    report(name,"destuff",kernel,bytes,&t);
+}
+
+static void bench_crc(const char *name, const unsigned char *data, int size) {
+    for(int fcs = 0; fcs < 2; fcs++) {
+        long long bytes = 0;
+        timer t;
+        timer_start(&t);
+        do {
+            for(int i = 0; i < size; i += CHUNK) {
+                int chunk = size - i < CHUNK ? size - i : CHUNK;
+                sink += fcs ? crc32c(data + i,chunk) : crc16_ccitt(data + i,chunk);
+            }
+            bytes += size;
+        } while(timer_elapsed(&t) < MIN_TIME);
+        report(name,fcs ? "crc32c" : "crc16","-",bytes,&t);
+    }
+}
+
+// Parity of every codeword, then the check of codewords without errors, which is what llread() does on a clean line
+static void bench_fec(const char *name, const unsigned char *data, int size) {
+    fecCode code;
+    fec_init(&code,FEC_PARITY);
+    int codewords = (size + FEC_DATA(FEC_PARITY) - 1) / FEC_DATA(FEC_PARITY);
+    unsigned char *coded = malloc((size_t)codewords * FEC_BLOCK);
+    for(int pass = 0; pass < 2; pass++) {
+        long long bytes = 0;
+        timer t;
+        timer_start(&t);
+        do {
+            for(int i = 0, n = 0; i < size; i += FEC_DATA(FEC_PARITY), n++) {
+                int chunk = size - i < FEC_DATA(FEC_PARITY) ? size - i : FEC_DATA(FEC_PARITY);
+                unsigned char *codeword = coded + (size_t)n * FEC_BLOCK;
+                if(pass == 0) {
+                    unsigned char remainder[FEC_MAX_PARITY] = {0};
+                    fec_encode(&code,remainder,data + i,chunk);
+                    memcpy(codeword,data + i,chunk);
+                    memcpy(codeword + chunk,remainder,FEC_PARITY);
+                } else {
+                    sink += fec_decode(&code,codeword,chunk + FEC_PARITY);
+                }
+            }
+            bytes += size;
+        } while(timer_elapsed(&t) < MIN_TIME);
+        report(name,pass == 0 ? "fec_encode" : "fec_decode","-",bytes,&t);
+    }
+    free(coded);
+}
+
+// Appends a frame with the stuffed payload and its BCC2 (none for control frames)
+static int put_frame(unsigned char *dst, unsigned char control, const unsigned char *payload, int size) {
+    int n = 0;
+    dst[n++] = FLAG;
+    dst[n++] = A_TX;
+    dst[n++] = control;
+    dst[n++] = A_TX ^ control;
+    if(payload != NULL) {
+        unsigned char bcc2 = 0;
+        int escaped = 0;
+        n += stuff(payload,size,dst + n,&bcc2,&escaped);
+        n += stuff(&bcc2,1,dst + n,&bcc2,&escaped);
+    }
+    dst[n++] = FLAG;
+    return n;
+}
+
+// A file in memory with the bytes the peer sends, read by the link through the fd transport
+static int peer_file(const unsigned char *bytes, int size) {
+    FILE *file = tmpfile();
+    if(file == NULL || fwrite(bytes,1,size,file) != size) {
+        perror("tmpfile");
+        exit(1);
+    }
+    fflush(file);
+    int fd = dup(fileno(file));
+    fclose(file);
+    lseek(fd,0,SEEK_SET);
+    return fd;
+}
+
+static linkLayer link_parameters(int role, int in, int out) {
+    linkLayer ll = {0};
+    snprintf(ll.serialPort,sizeof(ll.serialPort),"fd:%d,%d",in,out);
+    ll.role = role;
+    ll.numTries = 1;
+    ll.timeOut = 1;
+    ll.windowSize = 1;
+    return ll;
+}
+
+// llwrite() of every chunk, the peer acknowledges each frame with RR(N(S))
+static void bench_llwrite(const char *name, const unsigned char *data, int size, int devnull) {
+    int frames = (size + CHUNK - 1) / CHUNK;
+    unsigned char *peer = malloc((frames + 3) * 5);
+    int n = put_frame(peer,UA,NULL,0);
+    for(int i = 0; i < frames; i++)
+        n += put_frame(peer + n,RR_CTRL(i % 2),NULL,0);
+    n += put_frame(peer + n,DISC,NULL,0);
+    int in = peer_file(peer,n);
+    free(peer);
+
+    linkConnection *link = llopen_link(link_parameters(TRANSMITTER,in,devnull));
+    if(link == NULL) {
+        fprintf(stderr,"llopen failed\n");
+        exit(1);
+    }
+    timer t;
+    timer_start(&t);
+    for(int i = 0; i < size; i += CHUNK)
+        if(llwrite_link(link,(unsigned char *)data + i,size - i < CHUNK ? size - i : CHUNK) < 0) {
+            fprintf(stderr,"llwrite failed\n");
+            exit(1);
+        }
+    report(name,"llwrite","-",size,&t);
+    llclose_link(link,FALSE);
+    close(in);
+}
+
+// llread() of every chunk sent by the peer in I frames
+static void bench_llread(const char *name, const unsigned char *data, int size, int devnull) {
+    int frames = (size + CHUNK - 1) / CHUNK;
+    unsigned char *peer = malloc(2 * size + (frames + 3) * 10), packet[CHUNK];
+    int n = put_frame(peer,SET,NULL,0);
+    for(int i = 0; i < frames; i++)
+        n += put_frame(peer + n,I_CTRL(i % 2),data + i * CHUNK,size - i * CHUNK < CHUNK ? size - i * CHUNK : CHUNK);
+    n += put_frame(peer + n,DISC,NULL,0);
+    n += put_frame(peer + n,UA,NULL,0);
+    int in = peer_file(peer,n);
+    free(peer);
+
+    linkConnection *link = llopen_link(link_parameters(RECEIVER,in,devnull));
+    if(link == NULL) {
+        fprintf(stderr,"llopen failed\n");
+        exit(1);
+    }
+    long long bytes = 0;
+    timer t;
+    timer_start(&t);
+    for(int i = 0; i < frames; i++) {
+        int read = llread_link(link,packet);
+        if(read < 0) {
+            fprintf(stderr,"llread failed\n");
+            exit(1);
+        }
+        bytes += read;
+    }
+    report(name,"llread","-",bytes,&t);
+    llclose_link(link,FALSE);
+    close(in);
+}
+
+static void bench_data(const char *name, const unsigned char *data, int size) {
+    // Frames as llread() gets them: stuffed payload, BCC2 and FLAG
+    unsigned char *frames = malloc(2 * size + 4 * (size / CHUNK + 1));
+    int frames_size = 0;
+    for(int i = 0; i < size; i += CHUNK) {
+        unsigned char bcc2 = 0;
+        int escaped = 0, chunk = size - i < CHUNK ? size - i : CHUNK;
+        frames_size += stuff(data + i,chunk,frames + frames_size,&bcc2,&escaped);
+        frames_size += stuff(&bcc2,1,frames + frames_size,&bcc2,&escaped);
+        frames[frames_size++] = FLAG;
+    }
+
+    int used = -1;
+    for(int kernel = STUFFING_SCALAR; kernel <= STUFFING_AVX2; kernel++) {
+        if(stuffing_select(kernel) == used)
+            continue; // not supported, it fell back to one already measured
+        used = stuffing_select(kernel);
+        bench_stuff(name,data,size,kernel_name(used));
+        bench_clean_run(name,data,size,kernel_name(used));
+        bench_destuff(name,frames,frames_size,size,kernel_name(used));
+    }
+    stuffing_select(STUFFING_AVX2); // best kernel for the rest
+    free(frames);
+
+    bench_crc(name,data,size);
+    bench_fec(name,data,size);
+    int devnull = open("/dev/null",O_WRONLY);
+    bench_llwrite(name,data,size,devnull);
+    bench_llread(name,data,size,devnull);
+    close(devnull);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, size = DATA_SIZE;
+    while((opt = getopt(argc,argv,"s:")) != -1) {
+        if(opt == 's')
+            size = atoi(optarg);
+        else {
+            printf("usage: microbench [-s bytes] [file...]\n");
+            return 1;
+        }
+    }
+    if(size <= 0)
+        size = DATA_SIZE;
+
+    unsigned char *data = malloc(size);
+    if(data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    printf("%-14s %-10s %-7s %10s %12s %10s\n","data","routine","kernel","ns/byte","cycles/byte","MB/s");
+
+    srand(1);
+    for(int i = 0; i < size; i++)
+        data[i] = rand();
+    bench_data("random",data,size);
+
+    // Worst case: every byte is escaped
+    for(int i = 0; i < size; i++)
+        data[i] = i % 2 ? ESC : FLAG;
+    bench_data("flag/esc",data,size);
+
+    const char *default_files[] = {"penguin.gif"};
+    char **files = optind < argc ? &argv[optind] : (char **)default_files;
+    int file_count = optind < argc ? argc - optind : 1;
+    for(int i = 0; i < file_count; i++) {
+        int fd = open(files[i],O_RDONLY), file_size = 0, n;
+        if(fd < 0) {
+            perror(files[i]);
+            continue;
+        }
+        while(file_size < size && (n = read(fd,data + file_size,size - file_size)) > 0)
+            file_size += n;
+        close(fd);
+        const char *base = strrchr(files[i],'/');
+        if(file_size > 0)
+            bench_data(base ? base + 1 : files[i],data,file_size);
+    }
+    free(data);
+    return 0;
+}
@@ -5,17 +5,188 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #define BAUDRATE B38400
 #define _POSIX_SOURCE 1 /* POSIX compliant source */
 #define FALSE 0
 #define TRUE 1
 
+#define LINE_BUFFER (1 << 20) // bytes on the way in one direction, power of two
+#define PORT_QUEUE 4096 // bytes a port takes ahead of the line, like the output buffer of a serial port
+#define CHUNK 512
+
 volatile int STOP=FALSE;
 
+/*
+ * Impairments of the line, the same in both directions
+ * Gilbert-Elliott: every byte the channel moves from the good to the bad state with
+ * probability p_bad and back with p_good, bits are flipped with ber or ber_bad
+ */
+typedef struct impairments {
+    double ber; // bit error rate (of the good state)
+    double p_bad, p_good, ber_bad;
+    double drop; // probability of losing a byte
+    double insert; // probability of a random byte showing up after a byte
+    long long delay; // one way propagation delay, ns
+    long baud; // 10 bits per byte (8N1); 0 forwards at pty speed
+    unsigned long long seed;
+} impairments;
+
+/*
+ * One direction of the cable: bytes read from one end wait here until they were
+ * serialized at the baud rate and propagated, then they are written to the other end
+ */
+typedef struct line {
+    int in, out;
+    unsigned char data[LINE_BUFFER];
+    unsigned long long due[LINE_BUFFER]; // ns at which the byte reaches the other end
+    unsigned int head, tail; // free running
+    unsigned long long free_at; // ns at which the line finishes sending the last byte
+    unsigned long long random;
+    int bad;
+    long long bytes, flipped, dropped, inserted;
+} line;
+
+static impairments imp;
+static line tx2rx, rx2tx;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, each direction has its own sequence so the impairments only depend on the seed and the bytes sent
+static double uniform(line *l) {
+    l->random ^= l->random >> 12;
+    l->random ^= l->random << 25;
+    l->random ^= l->random >> 27;
+    return ((l->random * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void line_init(line *l, int in, int out, int direction) {
+    l->in = in;
+    l->out = out;
+    l->head = l->tail = 0;
+    l->free_at = 0;
+    l->bad = FALSE;
+    l->bytes = l->flipped = l->dropped = l->inserted = 0;
+    l->random = (imp.seed + direction) * 0x9e3779b97f4a7c15ULL; // splitmix64 increment
+    if (l->random == 0)
+        l->random = 1;
+}
+
+static unsigned long long byte_time() {
+    return imp.baud ? 10000000000ULL / imp.baud : 0;
+}
+
+// The port takes more bytes while the line has less than PORT_QUEUE of them to send
+static int line_accepts(line *l, unsigned long long now) {
+    return LINE_BUFFER - (l->head - l->tail) >= 2 * CHUNK && l->free_at < now + PORT_QUEUE * byte_time();
+}
+
+// Puts a byte on the line after the ones already there; a lost byte still takes its time on the line
+static void line_push(line *l, unsigned char byte, int lost, unsigned long long now) {
+    l->free_at = (l->free_at > now ? l->free_at : now) + byte_time();
+    if (lost)
+        return;
+    l->data[l->head & (LINE_BUFFER - 1)] = byte;
+    l->due[l->head & (LINE_BUFFER - 1)] = l->free_at + imp.delay;
+    l->head++;
+}
+
+static void line_send(line *l, unsigned char *buf, int size, unsigned long long now) {
+    for (int i = 0; i < size; i++) {
+        unsigned char byte = buf[i];
+        l->bytes++;
+        if (imp.p_bad > 0 && uniform(l) < (l->bad ? imp.p_good : imp.p_bad))
+            l->bad = !l->bad;
+        double ber = l->bad ? imp.ber_bad : imp.ber;
+        if (ber > 0)
+            for (int bit = 0; bit < 8; bit++)
+                if (uniform(l) < ber) {
+                    byte ^= 1 << bit;
+                    l->flipped++;
+                }
+        int lost = imp.drop > 0 && uniform(l) < imp.drop;
+        l->dropped += lost;
+        line_push(l, byte, lost, now);
+        if (imp.insert > 0 && uniform(l) < imp.insert) {
+            line_push(l, (unsigned char)(uniform(l) * 256), FALSE, now);
+            l->inserted++;
+        }
+    }
+}
+
+// Writes the bytes that reached the other end, returns the ns until the next one does or -1 if nothing is on the way
+static long long line_deliver(line *l, unsigned long long now) {
+    while (l->tail != l->head && l->due[l->tail & (LINE_BUFFER - 1)] <= now) {
+        unsigned int offset = l->tail & (LINE_BUFFER - 1), count = 0;
+        while (offset + count < LINE_BUFFER && l->tail + count != l->head && l->due[offset + count] <= now)
+            count++;
+        int written = write(l->out, &l->data[offset], count);
+        if (written <= 0)
+            return 1000000; // the other end is full, try again in a millisecond
+        l->tail += written;
+    }
+    return l->tail == l->head ? -1 : (long long)(l->due[l->tail & (LINE_BUFFER - 1)] - now);
+}
+
+// Reads what one end sent, returns how many bytes were read
+static int line_read(line *l, unsigned char *buf, int connection, unsigned long long now) {
+    int size = read(l->in, buf, CHUNK);
+    if (size <= 0)
+        return 0;
+    if (connection == 200)
+        buf[0] = buf[0] ^ 0xFF;
+    if (connection)
+        line_send(l, buf, size, now);
+    return size;
+}
+
+static void usage() {
+    printf("usage: cable [-e ber] [-g p_bad,p_good,ber_bad] [-d drop] [-i insert] [-l delay_ms] [-b baud] [-s seed]\n");
+    exit(1);
+}
+
 int main(int argc, char** argv)
 {
+    int opt;
+    imp.seed = 1;
+    while ((opt = getopt(argc, argv, "e:g:d:i:l:b:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                imp.ber = atof(optarg);
+                break;
+            case 'g':
+                if (sscanf(optarg, "%lf,%lf,%lf", &imp.p_bad, &imp.p_good, &imp.ber_bad) != 3)
+                    usage();
+                break;
+            case 'd':
+                imp.drop = atof(optarg);
+                break;
+            case 'i':
+                imp.insert = atof(optarg);
+                break;
+            case 'l':
+                imp.delay = atof(optarg) * 1000000;
+                break;
+            case 'b':
+                imp.baud = atol(optarg);
+                break;
+            case 's':
+                imp.seed = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+        }
+    }
+
     printf("\n");
 
     system("socat -d -d PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
@@ -32,7 +203,10 @@ int main(int argc, char** argv)
             "The cable program is sensible to the following interactive commands:\n"
             "--- on   : connects the cable and data is exchanged (default state)\n"
             "--- off  : disconnects the cable disabling data to be exchanged\n"
-            "--- end  : terminates de program \n \n" );
+            "--- noise: flips the first byte of every read\n"
+            "--- end  : terminates de program \n \n"
+            "Line: BER %g, Gilbert-Elliott %g/%g BER %g, drop %g, insert %g, delay %lld ms, baud %ld (0: pty speed), seed %llu\n \n",
+            imp.ber, imp.p_bad, imp.p_good, imp.ber_bad, imp.drop, imp.insert, imp.delay / 1000000, imp.baud, imp.seed );
 
     int fdTx;
     struct termios oldtioTx,newtioTx;
@@ -53,8 +227,8 @@ int main(int argc, char** argv)
     newtioTx.c_iflag = IGNPAR;
     newtioTx.c_oflag = 0;
     newtioTx.c_lflag = 0;
-    newtioTx.c_cc[VTIME]    = 1;   /* inter-character timer unused */
-    newtioTx.c_cc[VMIN]     = 0;   /* blocking read until 5 chars received */
+    newtioTx.c_cc[VTIME]    = 0;   /* inter-character timer unused */
+    newtioTx.c_cc[VMIN]     = 0;   /* read returns what is there, poll() waits */
     tcflush(fdTx, TCIOFLUSH);
     if (tcsetattr(fdTx,TCSANOW,&newtioTx) == -1) {
         perror("tcsetattr");
@@ -81,8 +255,8 @@ int main(int argc, char** argv)
     newtioRx.c_iflag = IGNPAR;
     newtioRx.c_oflag = 0;
     newtioRx.c_lflag = 0;
-    newtioRx.c_cc[VTIME]    = 1;   /* inter-character timer unused */
-    newtioRx.c_cc[VMIN]     = 0;   /* blocking read until 5 chars received */
+    newtioRx.c_cc[VTIME]    = 0;   /* inter-character timer unused */
+    newtioRx.c_cc[VMIN]     = 0;   /* read returns what is there, poll() waits */
     tcflush(fdRx, TCIOFLUSH);
     if (tcsetattr(fdRx,TCSANOW,&newtioRx) == -1) {
         perror("tcsetattr");
@@ -95,54 +269,57 @@ int main(int argc, char** argv)
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
 
-    unsigned char tx2rx[512];
-    unsigned char rx2tx[512];
+    unsigned char fromTxBuf[CHUNK];
+    unsigned char fromRxBuf[CHUNK];
     unsigned char rxStdin[512];
 
-    int fromTx, toRx;
-    int fromRx, toTx;
+    int fromTx, fromRx;
     int fromStdin;
     int connection=100;
 
+    line_init(&tx2rx, fdTx, fdRx, 0);
+    line_init(&rx2tx, fdRx, fdTx, 1);
+    struct pollfd fds[3] = {{fdTx, POLLIN, 0}, {fdRx, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+
     while (STOP==FALSE) {
 
-        fromTx = read(fdTx,tx2rx,512);
-        if (fromTx){
-            if (connection) {
-                if (connection == 200) {
-                    tx2rx[0] = tx2rx[0] ^ 0xFF;
-                }
-                toRx=write(fdRx,tx2rx,fromTx);
-                printf("fromTx=%d > toRx= %d \n", fromTx, toRx);
-                fromTx=0;
-                toRx=0;
-            } else {
+        // Sleep until a byte arrives, a byte reaches the other end or a port can take more bytes
+        unsigned long long now = now_ns();
+        long long wait = -1, next;
+        if ((next = line_deliver(&tx2rx, now)) >= 0)
+            wait = next;
+        if ((next = line_deliver(&rx2tx, now)) >= 0 && (wait < 0 || next < wait))
+            wait = next;
+        fds[0].events = line_accepts(&tx2rx, now) ? POLLIN : 0;
+        fds[1].events = line_accepts(&rx2tx, now) ? POLLIN : 0;
+        if (!fds[0].events || !fds[1].events)
+            wait = wait >= 0 && wait < 1000000 ? wait : 1000000;
+        poll(fds, 3, wait < 0 ? -1 : (int)((wait + 999999) / 1000000));
+        now = now_ns();
+
+        if (fds[0].revents & POLLIN) {
+            fromTx = line_read(&tx2rx, fromTxBuf, connection, now);
+            if (connection)
+                printf("fromTx=%d > toRx \n", fromTx);
+            else if (fromTx)
                 printf("fromTx=%d > toRx= CONNECTION OFF \n", fromTx);
-                fromTx=0;
-                toRx=0;
-            }
         }
 
-
-        fromRx = read(fdRx,rx2tx,512);
-        if (fromRx) {
-            if (connection) {
-                if (connection == 200) {
-                    rx2tx[0] = rx2tx[0] ^ 0xFF;
-                }
-                toTx=write(fdTx,rx2tx,fromRx);
-                printf("toTx= %d < fromRx=%d \n", toTx, fromRx);
-                fromRx=0;
-                toTx=0;
-            } else {
-                printf("toTx= CONNECTION OFF < fromRx=%d \n",  fromRx);
-                fromRx=0;
-                toTx=0;
-            }
+        if (fds[1].revents & POLLIN) {
+            fromRx = line_read(&rx2tx, fromRxBuf, connection, now);
+            if (connection)
+                printf("toTx < fromRx=%d \n", fromRx);
+            else if (fromRx)
+                printf("toTx= CONNECTION OFF < fromRx=%d \n", fromRx);
         }
 
-
-        fromStdin=read(STDIN_FILENO, rxStdin, 512);
+        if (fds[2].revents & (POLLIN | POLLHUP)) {
+            fromStdin=read(STDIN_FILENO, rxStdin, 511);
+            if (fromStdin == 0)
+                fds[2].fd = -1; // no more commands
+        } else {
+            fromStdin = 0;
+        }
         if (fromStdin>0) {
             rxStdin[fromStdin-1]=0;
             if (strcmp(rxStdin, "off")==0 || strcmp(rxStdin, "0")==0 ) {
@@ -164,6 +341,8 @@ int main(int argc, char** argv)
         }
     }
 
+    printf("tx > rx: %lld bytes, %lld bits flipped, %lld bytes dropped, %lld inserted\n", tx2rx.bytes, tx2rx.flipped, tx2rx.dropped, tx2rx.inserted);
+    printf("rx > tx: %lld bytes, %lld bits flipped, %lld bytes dropped, %lld inserted\n", rx2tx.bytes, rx2tx.flipped, rx2tx.dropped, rx2tx.inserted);
 
     if (tcsetattr(fdRx,TCSANOW,&oldtioRx)==-1) {
         perror("tcsetattr");
@@ -0,0 +1,99 @@
+#include "crc.h"
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define X86_64 1
+#else
+#define X86_64 0
+#endif
+
+#define CRC16_POLY 0x8408      // 0x1021 reflected
+#define CRC32C_POLY 0x82f63b78 // 0x1edc6f41 reflected
+
+/*
+ * Slice-by-8: table[k][b] is the CRC of byte b followed by k zero bytes, so
+ * 8 input bytes are folded with 8 independent lookups instead of 8 dependent ones.
+ * Both CRCs are reflected and at most 32 bits wide, so they share the same loop
+ */
+static uint32_t crc16_table[8][256], crc32c_table[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT; // links in different threads build the tables once
+static int use_sse42 = 0;
+
+static void build_table(uint32_t table[8][256], uint32_t poly) {
+    for(int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for(int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][b] = crc;
+    }
+    for(int k = 1; k < 8; k++)
+        for(int b = 0; b < 256; b++)
+            table[k][b] = (table[k-1][b] >> 8) ^ table[0][table[k-1][b] & 0xff];
+}
+
+static void init_tables() {
+    build_table(crc16_table,CRC16_POLY);
+    build_table(crc32c_table,CRC32C_POLY);
+    #if X86_64
+    __builtin_cpu_init();
+    use_sse42 = __builtin_cpu_supports("sse4.2");
+    #endif
+}
+
+static uint32_t slice_by_8(uint32_t table[8][256], uint32_t crc, const unsigned char *data, int size) {
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(; size >= 8; data += 8, size -= 8) {
+        uint32_t one, two;
+        memcpy(&one,data,4);
+        memcpy(&two,data + 4,4);
+        one ^= crc;
+        crc = table[7][one & 0xff] ^ table[6][(one >> 8) & 0xff] ^ table[5][(one >> 16) & 0xff] ^ table[4][one >> 24] ^
+              table[3][two & 0xff] ^ table[2][(two >> 8) & 0xff] ^ table[1][(two >> 16) & 0xff] ^ table[0][two >> 24];
+    }
+    #endif
+    for(; size > 0; data++, size--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+    return crc;
+}
+
+#if X86_64
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, int size) {
+    uint64_t crc64 = crc;
+    for(; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word,data,8);
+        crc64 = _mm_crc32_u64(crc64,word);
+    }
+    crc = crc64;
+    for(; size > 0; data++, size--)
+        crc = _mm_crc32_u8(crc,*data);
+    return crc;
+}
+#endif
+
+// The final XOR is undone first, so a finished CRC can be continued
+unsigned int crc16_ccitt_update(unsigned int crc, const unsigned char *data, int size) {
+    pthread_once(&tables_once,init_tables);
+    return slice_by_8(crc16_table,crc ^ 0xffff,data,size) ^ 0xffff;
+}
+
+unsigned int crc32c_update(unsigned int crc, const unsigned char *data, int size) {
+    pthread_once(&tables_once,init_tables);
+    #if X86_64
+    if(use_sse42)
+        return crc32c_sse42(crc ^ 0xffffffff,data,size) ^ 0xffffffff;
+    #endif
+    return slice_by_8(crc32c_table,crc ^ 0xffffffff,data,size) ^ 0xffffffff;
+}
+
+unsigned int crc16_ccitt(const unsigned char *data, int size) {
+    return crc16_ccitt_update(0,data,size);
+}
+
+unsigned int crc32c(const unsigned char *data, int size) {
+    return crc32c_update(0,data,size);
+}
@@ -0,0 +1,12 @@
+#ifndef CRC
+#define CRC
+
+// CRC-16-CCITT as used by the HDLC FCS (reflected 0x1021, init and final XOR 0xffff)
+unsigned int crc16_ccitt(const unsigned char *data, int size);
+// CRC-32C Castagnoli (reflected 0x1edc6f41, init and final XOR 0xffffffff), uses the SSE4.2 crc32 instruction when available
+unsigned int crc32c(const unsigned char *data, int size);
+// Continue a CRC returned by the functions above (0 to start one) over more data, for data split in several buffers
+unsigned int crc16_ccitt_update(unsigned int crc, const unsigned char *data, int size);
+unsigned int crc32c_update(unsigned int crc, const unsigned char *data, int size);
+
+#endif
@@ -0,0 +1,194 @@
+#include "fec.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#else
+#define X86 0
+#endif
+
+#define GF_POLY 0x11d
+
+static unsigned char gf_exp[512], gf_log[256]; // exp is doubled so a sum of two logs needs no modulo
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT; // links in different threads build the tables once
+static int use_sse2 = 0;
+
+static void init_tables() {
+    int x = 1;
+    for(int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if(x & 0x100)
+            x ^= GF_POLY;
+    }
+    #if X86
+    __builtin_cpu_init();
+    use_sse2 = __builtin_cpu_supports("sse2");
+    #endif
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b) {
+    return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+int fec_init(fecCode *code, int parity) {
+    pthread_once(&tables_once,init_tables);
+    if(parity < 2 || parity > FEC_MAX_PARITY)
+        return -1;
+
+    // (x - 1)(x - a)...(x - a^(parity-1))
+    memset(code,0,sizeof(fecCode));
+    code->parity = parity;
+    code->generator[0] = 1;
+    for(int j = 0; j < parity; j++)
+        for(int i = j + 1; i > 0; i--)
+            code->generator[i] ^= gf_mul(code->generator[i - 1],gf_exp[j]);
+    for(int b = 0; b < 256; b++)
+        for(int i = 0; i < parity; i++)
+            code->product[b][i] = gf_mul(b,code->generator[i + 1]);
+    return 1;
+}
+
+/*
+ * Division by the generator as a shift register: each byte shifts the remainder by one
+ * and adds the product row of the byte that falls out, looked up whole.
+ * The SSE2 kernel keeps the 32 byte remainder in two registers, so a byte costs a lookup, two shifts and two XORs
+ */
+static void encode_scalar(const fecCode *code, unsigned char *remainder, const unsigned char *data, int size) {
+    int parity = code->parity;
+    for(int n = 0; n < size; n++) {
+        const unsigned char *row = code->product[data[n] ^ remainder[0]];
+        for(int i = 0; i < parity - 1; i++)
+            remainder[i] = remainder[i + 1] ^ row[i];
+        remainder[parity - 1] = row[parity - 1];
+    }
+}
+
+#if X86
+
+__attribute__((target("sse2")))
+static void encode_sse2(const fecCode *code, unsigned char *remainder, const unsigned char *data, int size) {
+    __m128i low = _mm_loadu_si128((const __m128i *)remainder), high = _mm_loadu_si128((const __m128i *)(remainder + 16));
+    for(int n = 0; n < size; n++) {
+        const unsigned char *row = code->product[data[n] ^ (unsigned char)_mm_cvtsi128_si32(low)];
+        low = _mm_or_si128(_mm_srli_si128(low,1),_mm_slli_si128(high,15));
+        high = _mm_srli_si128(high,1);
+        low = _mm_xor_si128(low,_mm_loadu_si128((const __m128i *)row));
+        high = _mm_xor_si128(high,_mm_loadu_si128((const __m128i *)(row + 16)));
+    }
+    _mm_storeu_si128((__m128i *)remainder,low);
+    _mm_storeu_si128((__m128i *)(remainder + 16),high);
+}
+
+#endif
+
+void fec_encode(const fecCode *code, unsigned char *remainder, const unsigned char *data, int size) {
+    #if X86
+    if(use_sse2) {
+        encode_sse2(code,remainder,data,size);
+        return;
+    }
+    #endif
+    encode_scalar(code,remainder,data,size);
+}
+
+/*
+ * The remainder of the received codeword divided by the generator is the sum of the remainders of the errors,
+ * zero when there are none, so only a damaged codeword goes through syndromes, Berlekamp-Massey to find the
+ * error locator, a Chien search for its roots (the positions) and Forney for the values
+ */
+int fec_decode(const fecCode *code, unsigned char *codeword, int size) {
+    int parity = code->parity, data = size - parity;
+    if(data < 1 || size > FEC_BLOCK)
+        return -1;
+    unsigned char remainder[FEC_MAX_PARITY] = {0};
+    fec_encode(code,remainder,codeword,data);
+    int damaged = 0;
+    for(int i = 0; i < parity; i++) {
+        remainder[i] ^= codeword[data + i];
+        damaged |= remainder[i];
+    }
+    if(!damaged)
+        return 0;
+
+    // S(j) is the remainder evaluated at a^j, a root of the generator
+    unsigned char syndrome[FEC_MAX_PARITY];
+    for(int j = 0; j < parity; j++) {
+        unsigned char s = 0;
+        for(int i = 0; i < parity; i++)
+            s = gf_mul(s,gf_exp[j]) ^ remainder[i];
+        syndrome[j] = s;
+    }
+
+    // Error locator L(x), lowest degree first
+    unsigned char locator[FEC_MAX_PARITY + 1] = {1}, previous[FEC_MAX_PARITY + 1] = {1}, saved[FEC_MAX_PARITY + 1];
+    int errors = 0, shift = 1;
+    unsigned char previous_discrepancy = 1;
+    for(int n = 0; n < parity; n++) {
+        unsigned char discrepancy = syndrome[n];
+        for(int i = 1; i <= errors; i++)
+            discrepancy ^= gf_mul(locator[i],syndrome[n - i]);
+        if(discrepancy == 0) {
+            shift++;
+            continue;
+        }
+        unsigned char scale = gf_div(discrepancy,previous_discrepancy);
+        memcpy(saved,locator,sizeof(saved));
+        for(int i = 0; i + shift <= parity; i++)
+            locator[i + shift] ^= gf_mul(scale,previous[i]);
+        if(2 * errors <= n) {
+            errors = n + 1 - errors;
+            memcpy(previous,saved,sizeof(previous));
+            previous_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if(2 * errors > parity)
+        return -1;
+
+    // Error evaluator O(x) = S(x) L(x) mod x^parity
+    unsigned char evaluator[FEC_MAX_PARITY] = {0};
+    for(int i = 0; i < parity; i++)
+        for(int j = 0; j <= errors && j <= i; j++)
+            evaluator[i] ^= gf_mul(syndrome[i - j],locator[j]);
+
+    // Byte i of the codeword is the coefficient of x^(size-1-i), an error there makes L(a^-(size-1-i)) zero
+    int found = 0, position[FEC_MAX_PARITY / 2];
+    unsigned char magnitude[FEC_MAX_PARITY / 2];
+    for(int i = 0; i < size && found < errors; i++) {
+        int power = size - 1 - i;
+        unsigned char inverse = gf_exp[(255 - power) % 255], value = 0, x = 1, derivative = 0;
+        for(int j = 0; j <= errors; j++) {
+            value ^= gf_mul(locator[j],x);
+            if(j & 1) // formal derivative, even terms vanish in GF(2^8)
+                derivative ^= gf_mul(locator[j],gf_div(x,inverse));
+            x = gf_mul(x,inverse);
+        }
+        if(value != 0)
+            continue;
+        unsigned char omega = 0;
+        x = 1;
+        for(int j = 0; j < parity; j++) {
+            omega ^= gf_mul(evaluator[j],x);
+            x = gf_mul(x,inverse);
+        }
+        if(derivative == 0)
+            return -1;
+        position[found] = i;
+        magnitude[found++] = gf_mul(gf_exp[power],gf_div(omega,derivative));
+    }
+    if(found != errors) // some roots are outside the codeword: more errors than the code can locate
+        return -1;
+    for(int i = 0; i < found; i++)
+        codeword[position[i]] ^= magnitude[i];
+    return found;
+}
@@ -0,0 +1,29 @@
+#ifndef FEC
+#define FEC
+
+/*
+ * Reed-Solomon code over GF(256) (polynomial 0x11d, first root 1): every FEC_DATA(parity) data bytes
+ * are followed by parity bytes, which let the receiver correct up to parity/2 wrong bytes among them.
+ * The last codeword of a frame is shortened to the data left
+ */
+#define FEC_BLOCK 255 // bytes of a full codeword
+#define FEC_MAX_PARITY 32
+#define FEC_DATA(parity) (FEC_BLOCK - (parity))
+// Bytes that size data bytes take once the parity of every codeword is added
+#define FEC_SIZE(size,parity) ((size) + (parity) * (((size) + FEC_DATA(parity) - 1) / FEC_DATA(parity)))
+
+// Generator polynomial of a code and the product of every byte with it, so the encoder does one lookup per byte
+typedef struct fecCode {
+    int parity;
+    unsigned char generator[FEC_MAX_PARITY + 1]; // highest degree first, generator[0] is 1
+    unsigned char product[256][FEC_MAX_PARITY]; // product[b][i] = b * generator[i+1], zero after parity bytes
+} fecCode;
+
+// Builds the code with parity bytes per codeword (2 to FEC_MAX_PARITY), returns -1 if parity is out of range
+int fec_init(fecCode *code, int parity);
+// Continues the parity in remainder (FEC_MAX_PARITY bytes, zeroed for a new codeword) over size more data bytes
+void fec_encode(const fecCode *code, unsigned char *remainder, const unsigned char *data, int size);
+// Corrects in place a codeword of size bytes, data followed by parity; returns the bytes corrected or -1 if there are too many errors
+int fec_decode(const fecCode *code, unsigned char *codeword, int size);
+
+#endif
@@ -1,22 +1,25 @@
 #include "linklayer.h"
+#include "stuffing.h"
+#include "crc.h"
+#include "fec.h"
+#include "trace.h"
+#include "stats.h"
+#include "transport.h"
 #include <time.h>
-
-#ifndef DEBUG
-#define DEBUG 1
-#endif
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
 
 #ifndef RANDOM_ERROR_GENERATION
 #define RANDOM_ERROR_GENERATION 0
 #endif
 
-#define FLAG 0x5c
 #define A_TX 0x01
 #define A_RX 0x03
 #define SET  0x07
 #define DISC 0x0a
 #define UA   0x06
-#define ESC  0x5d
-#define ESC_XOR 0x20
 #define RR_0 0x01
 #define RR_1 0x11
 #define REJ_0 0x05
@@ -27,134 +30,534 @@
 #define I_1  0xc0
 #define I_XOR 0x40
 
-#define FRAME_MAX_SIZE 2007 // Worst case scenario frame size
+/*
+ * Sequence numbers with more than one bit (windowSize > 1) keep I_0/I_1, RR_0/RR_1
+ * and REJ_0/REJ_1 as the encodings of 0 and 1, so Stop-and-Wait frames are unchanged
+ * I: bit 6 holds the lowest bit of N(S) and bits 3-4 the upper ones
+ * RR/REJ: bits 4-6 hold N(R)
+ */
+#define I_CTRL(n)   (I_0 | (((n) & 1) << 6) | (((n) >> 1) << 3))
+#define I_SEQ(c)    ((((c) >> 6) & 1) | ((((c) >> 3) & 3) << 1))
+#define I_MORE      0x20 // the payload goes on in the next frame, only sent when both ends negotiated PARAM_SPLIT
+#define I_BUNDLE    0x04 // the payload holds several llwrite() payloads, each after its length, only sent when the peer sent PARAM_COALESCE
+#define IS_I(c)     (((c) & 0x83) == I_0)
+#define RR_CTRL(n)  (RR_0 | ((n) << 4))
+#define REJ_CTRL(n) (REJ_0 | ((n) << 4))
+#define R_SEQ(c)    (((c) >> 4) & 7)
+#define IS_RR(c)    (((c) & 0x8f) == RR_0)
+#define IS_REJ(c)   (((c) & 0x8f) == REJ_0)
+
+#define SEQ_MODULO 8 // sequence number space when windowSize > 1
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Linux limit of buffers per writev()
+#endif
+
+// Link parameters carried as TLV (type, length, value) in SET/UA
+#define PARAM_WINDOW 0x01
+#define PARAM_ARQ    0x02
+#define PARAM_FCS    0x03
+#define PARAM_PAYLOAD 0x04
+#define PARAM_BAUD   0x05
+#define PARAM_STEP   0x06
+#define PARAM_SPLIT  0x07
+#define PARAM_FEC    0x08
+#define PARAM_DATA   0x09
+#define PARAM_COALESCE 0x0a
+#define PARAMS_MAX_SIZE 64
 
 /*
- * File Descriptor is not present on struct linklayer {}, so we have to
- * create a global variable for it
- * Given that: This API can't handle two open connections at the same time
+ * Steps of the rate negotiation that follows SET/UA when both ends set maxBaudRate,
+ * sent in SET frames with PARAM_STEP and PARAM_BAUD and echoed in the UA that answers them
  */
-static int fd, res, s = 0, num_tries = MAX_RETRANSMISSIONS_DEFAULT, time_out = TIMEOUT_DEFAULT;
-static struct termios oldtio,newtio;
-time_t start,end;
+#define BAUD_SWITCH 0 // both ends move to the rate once the receiver answered
+#define BAUD_PROBE 1 // sent at the new rate, answered if it works in both directions
+#define BAUD_DONE 2 // the link stays at the rate
+#define BAUD_FALLBACK 3 // only traced: back to the last rate that worked
+
+#define FCS_MAX_SIZE 4
+#define FRAME_MAX_SIZE(coded) (5 + 2*(coded)) // Worst case scenario frame size, coded: bytes of payload and FCS with their FEC parity
+#define RX_BUFFER_SIZE 4096 // power of two, holds a couple of worst case frames
+#define RTO_MIN 50 // ms, shortest retransmission timeout of I frames
+#define SIZING_FRAMES 32 // I frames sent between two choices of the frame size
+#define SIZING_ERRORS 4 // or REJs and timeouts, so a noisy line shrinks the frames sooner
+#define MIN_FRAME_PAYLOAD 64 // smallest payload the frame size goes down to
+#define BUNDLE_HEADER 2 // length of each payload of a bundle, high byte first
 
 struct Statistics {
     int received_i_frames;
     int transmitted_i_frames;
+    int retransmitted_i_frames;
     int received_rej_frames;
     int transmitted_rej_frames;
+    int duplicate_i_frames; // received again after they were acknowledged
     int timeout_counter;
     int escaped_bytes;
-    int transmitted_bytes;
-    int received_bytes;
-    time_t total_time;
-    time_t average_frame_time;
-    time_t fastest_frame;
-    time_t slowest_frame;
+    long long transmitted_bytes;
+    long long received_bytes;
+    long long acknowledged_bytes; // payload of the frames the receiver acknowledged
+    uint64_t open_time, close_time; // ns, the link carries data in between
+    latencyHistogram frame_time; // llwrite()/llread() calls
+    latencyHistogram round_trip; // last transmission to acknowledgement, only frames sent once
+    latencyHistogram ack_time; // first transmission to acknowledgement
+    latencyHistogram retransmit_delay; // previous transmission to retransmission
+    int smallest_frame_payload, frame_resizes; // frame size chosen from the error rate
+    int corrected_i_frames, corrected_bytes; // repaired by FEC instead of rejected
+    int rejected_i_frames; // failed the FCS check
+    int coalesced_payloads; // llwrite() payloads sent in frames shared with others
 };
 
-static struct Statistics stats;
+/*
+ * Everything a link needs lives in its handle, so several links can be open at
+ * the same time, each one driven by a single thread.
+ * llopen/llwrite/llread/llclose use the handle of the link opened by llopen()
+ */
+struct linkConnection {
+    linkLayer parameters;
+    transport io;
+    int num_tries, time_out;
+    int window, arq_mode, modulo;
+    int fcs, fcs_size;
+    int max_payload;
+    int split; // llwrite() splits payloads into frames of frame_payload bytes, llread() joins them
+    int fec_parity; // Reed-Solomon parity bytes per codeword of I frames, 0 without FEC
+    fecCode *fec;
+    int coalesce_delay; // ms, llwrite() bundles small payloads for up to this long, 0 when it does not
+    long baud, max_baud; // bit/s, rate of the line and fastest rate both ends accept
+    unsigned char peer_data[OPEN_DATA_MAX]; // openData of the peer's SET/UA
+    int peer_data_size;
+    uint64_t start; // ns, beginning of the llwrite()/llread() call
 
-#if DEBUG
-    static int bcc2_tracker = 0;
-#endif
+    // Receiver: last UA sent by llopen(), sent again by llread() if the SET it answered arrives again
+    unsigned char ua_params[PARAMS_MAX_SIZE];
+    int ua_size;
 
-static float read_timeout(unsigned char *byte) {
-    float time = 0;
-    while(read(fd,byte,1) < 0 || time > time_out) {
-        time += 0.1;
-        sleep(0.1);
-    }
-    return time > time_out ? -1 : time;
-}
+    /*
+     * Frame buffers are sized once the maximum payload is agreed in llopen(),
+     * the transmitter only allocates tx_frames and the receiver rx_frame (and rx_packets for Selective Repeat)
+     */
+    unsigned char *tx_frames, *rx_frame, *rx_packets;
 
-static ssize_t send_cframe(unsigned char A,unsigned char C) {
-    unsigned char buf[5] = {FLAG, A, C, A^C, FLAG};
-    #if DEBUG
-    printf("            [send_cframe] %02x %02x %02x %02x %02x --> \n",buf[0],buf[1],buf[2],buf[3],buf[4]);
+    /*
+     * Transmitter: frames sent and not acknowledged yet, indexed by N(S)
+     * A frame is written with writev() from iov: llwrite() stuffs the whole frame into
+     * frame, llwritev() only puts the header, escaped bytes and trailer there and points
+     * iov at the clean runs of the caller's buffers
+     */
+    struct {
+        unsigned char *frame;
+        int size;
+        struct iovec *iov;
+        int iov_count, iov_capacity;
+        int payload, retransmitted;
+        int retries; // retransmissions counted against num_tries
+        uint64_t sent, last_sent; // ns, first and last transmission
+    } tx_window[SEQ_MODULO];
+    int tx_base, tx_next;
+    long long deadline; // CLOCK_MONOTONIC time (ms) at which the retransmission timer expires
+
+    /*
+     * Retransmission timeout of I frames as in TCP (RFC 6298): smoothed round trip and its variation,
+     * from frames acknowledged after a single transmission, and doubled on every timeout up to time_out
+     */
+    int64_t srtt, rttvar; // ns, srtt is 0 until the first round trip
+    long long rto; // ms
+
+    /*
+     * Transmitter: payload of the I frames when they are sized to the line, chosen from the REJs and
+     * timeouts seen since the previous choice and the bytes of the frames sent meanwhile
+     */
+    int frame_payload;
+    int sizing_frames, sizing_errors;
+    long long sizing_bytes;
+
+    /*
+     * Transmitter: small payloads held by llwrite() (coalesce_delay > 0), each after its length,
+     * sent as one frame when the next one does not fit, the delay passed since the first, or the link is flushed
+     */
+    unsigned char *bundle;
+    int bundle_size, bundle_count;
+    long long bundle_since; // ms, when the first payload was held
+
+    // Transmitter: thread of bundle_timer() while there is a bundle, llwrite() and llflush() hold tx_lock against it
+    pthread_t timer_thread;
+    pthread_mutex_t tx_lock;
+    pthread_cond_t bundle_held; // signaled when the bundle gets its first payload or the timer must stop
+    int timer_running, timer_stop;
+    int timer_failed; // the timer could not send the bundle, the next llwrite() or llflush() fails
+
+    // Receiver: frames accepted ahead of a missing one (Selective Repeat), indexed by N(S)
+    struct {
+        unsigned char *packet;
+        int size;
+        int valid, flags; // I_MORE and I_BUNDLE of its control byte
+    } rx_window[SEQ_MODULO];
+    int rx_expected, rx_deliver, rej_sent;
+
+    // Receiver: the bundle llread() returns one payload of at a time, rx_bundle_next is the length of the next one
+    unsigned char *rx_bundle;
+    int rx_bundle_size, rx_bundle_next;
+
+    /*
+     * Receive ring buffer, filled by read() with every byte the port has available
+     * instead of one syscall per byte; bytes of the next frame stay buffered
+     * between calls. rx_head and rx_tail are free running counters
+     */
+    unsigned char rx_buffer[RX_BUFFER_SIZE];
+    unsigned int rx_head, rx_tail;
+
+    struct Statistics stats;
+    traceRing trace;
+};
+
+static linkConnection *default_link = NULL;
+
+static int fill_rx_buffer(linkConnection *link) {
+    unsigned int offset = link->rx_head & (RX_BUFFER_SIZE - 1);
+    unsigned int free_space = RX_BUFFER_SIZE - (link->rx_head - link->rx_tail);
+    unsigned int contiguous = RX_BUFFER_SIZE - offset;
+    int n = transport_read(&link->io,&link->rx_buffer[offset],contiguous < free_space ? contiguous : free_space);
+    if(n > 0)
+        link->rx_head += n;
+    #if RANDOM_ERROR_GENERATION
+    for(int i = 0; i < n; i++)
+        if(rand() % 200 == 0)
+            link->rx_buffer[offset + i] ^= 0x01; // Jam the first bit
     #endif
-    return write(fd,buf,5);
+    return n;
+}
+
+static int read_byte(linkConnection *link, unsigned char *byte) {
+    if(link->rx_head == link->rx_tail && fill_rx_buffer(link) <= 0)
+        return -1;
+    *byte = link->rx_buffer[link->rx_tail++ & (RX_BUFFER_SIZE - 1)];
+    return 1;
 }
 
-static void bytestuff(unsigned char byte, unsigned char *frame, int *n) {
-    if(byte == FLAG || byte == ESC) {
-        frame[(*n)++] = ESC;
-        frame[(*n)++] = byte ^ ESC_XOR;
-        stats.escaped_bytes++;
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// (Re)starts the retransmission timer, read_timeout() gives up once it expires
+static void start_timer(linkConnection *link) {
+    link->deadline = now_ms() + link->time_out * 1000LL;
+}
+
+// Same for I frames, with the timeout estimated from the round trips
+static void start_rto_timer(linkConnection *link) {
+    link->deadline = now_ms() + link->rto;
+}
+
+static void rtt_sample(linkConnection *link, uint64_t rtt) {
+    if(link->srtt == 0) {
+        link->srtt = rtt;
+        link->rttvar = rtt / 2;
     } else {
-        frame[(*n)++] = byte;
+        int64_t error = link->srtt - (int64_t)rtt;
+        link->rttvar = (3 * link->rttvar + (error < 0 ? -error : error)) / 4;
+        link->srtt = (7 * link->srtt + (int64_t)rtt) / 8;
     }
-    return;
+    int64_t variation = 4 * link->rttvar > 1000000 ? 4 * link->rttvar : 1000000; // at least the 1 ms granularity of the timer
+    long long rto = (link->srtt + variation + 999999) / 1000000;
+    link->rto = rto < RTO_MIN ? RTO_MIN : rto > link->time_out * 1000LL ? link->time_out * 1000LL : rto;
 }
 
-// Opens a conection using the "port" parameters defined in struct linkLayer, returns "-1" on error and "1" on sucess
-int llopen(linkLayer connectionParameters) {
-    #if DEBUG
-    printf("[linklayer] llopen() opening socket\n");
-    #endif
+// Sleeps until a byte arrives or the timer expires, returns -1 on timeout
+static int read_timeout(linkConnection *link, unsigned char *byte) {
+    while(link->rx_head == link->rx_tail) {
+        long long remaining = link->deadline - now_ms();
+        if(remaining <= 0)
+            return -1;
+        int ready = transport_wait(&link->io,remaining);
+        if(ready < 0)
+            return -1;
+        if(ready > 0 && fill_rx_buffer(link) <= 0)
+            return -1;
+    }
+    return read_byte(link,byte);
+}
 
-    unsigned char buf[5];
+static ssize_t send_cframe(linkConnection *link, unsigned char A,unsigned char C) {
+    unsigned char buf[5] = {FLAG, A, C, A^C, FLAG};
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_SEND_CFRAME,0,A,C,0);
+    return transport_write(&link->io,buf,5);
+}
 
-    if(connectionParameters.timeOut)
-        time_out = connectionParameters.timeOut;
+// Sends a SET/UA frame with the link parameters as payload, protected by BCC2 like an I frame
+static ssize_t send_pframe(linkConnection *link, unsigned char A,unsigned char C, unsigned char *params, int params_size) {
+    unsigned char bcc2 = 0, frame[5 + 2*(PARAMS_MAX_SIZE + 1)];
+    int frame_size = 0;
+    frame[frame_size++] = FLAG;
+    frame[frame_size++] = A;
+    frame[frame_size++] = C;
+    frame[frame_size++] = A^C;
+    frame_size += stuff(params,params_size,&frame[frame_size],&bcc2,&link->stats.escaped_bytes);
+    frame_size += stuff(&bcc2,1,&frame[frame_size],&bcc2,&link->stats.escaped_bytes);
+    frame[frame_size++] = FLAG;
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_SEND_PFRAME,0,A,C,params_size);
+    return transport_write(&link->io,frame,frame_size);
+}
 
-    if(connectionParameters.numTries)
-        num_tries = connectionParameters.numTries;
+// Writes the frame check sequence of the data in iov to fcs_bytes (low byte first); bcc2 is the XOR folded by stuff()
+static void fcs_encode(linkConnection *link, const struct iovec *iov, int iovcnt, unsigned char bcc2, unsigned char *fcs_bytes) {
+    unsigned int crc = bcc2;
+    if(link->fcs != FCS_BCC2) {
+        crc = 0;
+        for(int i = 0; i < iovcnt; i++)
+            crc = link->fcs == FCS_CRC32C ? crc32c_update(crc,iov[i].iov_base,iov[i].iov_len) : crc16_ccitt_update(crc,iov[i].iov_base,iov[i].iov_len);
+    }
+    for(int i = 0; i < link->fcs_size; i++)
+        fcs_bytes[i] = crc >> (8*i);
+}
 
-    stats.received_i_frames = 0;
-    stats.transmitted_i_frames = 0;
-    stats.received_rej_frames = 0;
-    stats.transmitted_rej_frames = 0;
-    stats.timeout_counter = 0;
-    stats.escaped_bytes = 0;
-    stats.transmitted_bytes = 0;
-    stats.received_bytes = 0;
+// Checks the frame check sequence trailing the destuffed frame; bcc is the XOR of every destuffed byte
+static int fcs_check(linkConnection *link, const unsigned char *frame, int size, unsigned char bcc) {
+    if(size < link->fcs_size)
+        return FALSE;
+    if(link->fcs == FCS_BCC2)
+        return bcc == 0; // XOR of the data and BCC2 is 0 when they match
+    unsigned char fcs_bytes[FCS_MAX_SIZE];
+    struct iovec data = {(void *)frame, size - link->fcs_size};
+    fcs_encode(link,&data,1,0,fcs_bytes);
+    return memcmp(fcs_bytes,frame + size - link->fcs_size,link->fcs_size) == 0;
+}
 
-    stats.average_frame_time = 0;
-    stats.total_time = 0;
-    stats.fastest_frame = 9999999;
-    stats.slowest_frame = -1;
+static int params_encode(linkConnection *link, unsigned char *params) {
+    int n = 0;
+    params[n++] = PARAM_WINDOW;
+    params[n++] = 1;
+    params[n++] = link->window;
+    params[n++] = PARAM_ARQ;
+    params[n++] = 1;
+    params[n++] = link->arq_mode;
+    params[n++] = PARAM_FCS;
+    params[n++] = 1;
+    params[n++] = link->fcs;
+    params[n++] = PARAM_PAYLOAD;
+    params[n++] = 4;
+    for(int i = 0; i < 4; i++) // low byte first
+        params[n++] = link->max_payload >> (8*i);
+    if(link->max_baud > 0) {
+        params[n++] = PARAM_BAUD;
+        params[n++] = 4;
+        for(int i = 0; i < 4; i++)
+            params[n++] = link->max_baud >> (8*i);
+    }
+    params[n++] = PARAM_SPLIT; // also tells the peer that this end joins split payloads
+    params[n++] = 1;
+    params[n++] = link->split;
+    params[n++] = PARAM_FEC;
+    params[n++] = 1;
+    params[n++] = link->fec_parity;
+    params[n++] = PARAM_COALESCE; // this end splits bundles, whether it sends them is up to it
+    params[n++] = 1;
+    params[n++] = link->coalesce_delay > 0;
+    if(link->parameters.openDataSize > 0) {
+        params[n++] = PARAM_DATA;
+        params[n++] = link->parameters.openDataSize;
+        memcpy(&params[n],link->parameters.openData,link->parameters.openDataSize);
+        n += link->parameters.openDataSize;
+    }
+    return n;
+}
 
-    fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY );
-    if (fd < 0) { perror(connectionParameters.serialPort); exit(-1); }
-    if ( tcgetattr(fd,&oldtio) == -1) { /* save current port settings */
-        perror("tcgetattr");
-        exit(-1);
+// Value of a parameter of size bytes, low byte first
+static long param_value(const unsigned char *value, int size) {
+    long result = 0;
+    for(int j = size - 1; j >= 0; j--)
+        result = result << 8 | value[j];
+    return result;
+}
+
+// Adopts the parameters proposed by the peer; the window and payload are the smallest of both ends, the FCS and FEC the strongest
+static void params_decode(linkConnection *link, unsigned char *params, int params_size) {
+    int payload = MAX_PAYLOAD_SIZE; // peers that do not send it use the default
+    long baud = 0; // peers that do not send it keep the rate
+    int split = -1; // peers that do not send it cannot join split payloads
+    int fec_parity = -1; // nor decode FEC
+    int coalesce = FALSE; // nor split bundles
+    for(int i = 0; i + 2 <= params_size && i + 2 + params[i+1] <= params_size; i += 2 + params[i+1]) {
+        unsigned char *value = &params[i+2];
+        switch(params[i]) {
+            case PARAM_WINDOW:
+                if(value[0] >= 1 && value[0] < link->window)
+                    link->window = value[0];
+            break;
+            case PARAM_ARQ:
+                link->arq_mode = value[0] == SELECTIVE_REPEAT ? SELECTIVE_REPEAT : GO_BACK_N;
+            break;
+            case PARAM_FCS:
+                if(value[0] > link->fcs && value[0] <= FCS_CRC32C)
+                    link->fcs = value[0];
+            break;
+            case PARAM_PAYLOAD:
+                payload = param_value(value,params[i+1]);
+            break;
+            case PARAM_BAUD:
+                baud = param_value(value,params[i+1]);
+            break;
+            case PARAM_SPLIT:
+                split = value[0];
+            break;
+            case PARAM_FEC:
+                fec_parity = value[0] <= FEC_MAX_PARITY ? value[0] & ~1 : FEC_MAX_PARITY;
+            break;
+            case PARAM_COALESCE:
+                coalesce = TRUE;
+            break;
+            case PARAM_DATA:
+                link->peer_data_size = params[i+1] < OPEN_DATA_MAX ? params[i+1] : OPEN_DATA_MAX;
+                memcpy(link->peer_data,value,link->peer_data_size);
+            break;
+        }
     }
+    if(baud < link->max_baud)
+        link->max_baud = baud;
+    link->split = split < 0 ? FALSE : link->split || split;
+    link->fec_parity = fec_parity < 0 ? 0 : fec_parity > link->fec_parity ? fec_parity : link->fec_parity;
+    if(!coalesce)
+        link->coalesce_delay = 0;
+    if(link->arq_mode == SELECTIVE_REPEAT && link->window > SEQ_MODULO/2)
+        link->window = SEQ_MODULO/2;
+    if(payload >= 1 && payload < link->max_payload)
+        link->max_payload = payload;
+}
 
-    bzero(&newtio, sizeof(newtio));
-    newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
+// Bytes that size bytes of payload and FCS take in a frame once the FEC parity is added
+static int coded_size(linkConnection *link, int size) {
+    return link->fec_parity > 0 ? FEC_SIZE(size,link->fec_parity) : size;
+}
 
-    newtio.c_lflag = 0;
-    newtio.c_cc[VTIME]    = 0;   /* inter-character timer unused */
-    newtio.c_cc[VMIN]     = 1;   /* blocking read until 1 char received */
+// Allocates the frame buffers for the negotiated window and payload, returns -1 if there is not enough memory
+static int alloc_buffers(linkConnection *link) {
+    if(link->fec_parity > 0 && ((link->fec = malloc(sizeof(fecCode))) == NULL || fec_init(link->fec,link->fec_parity) < 0))
+        return -1;
+    int frame_size = FRAME_MAX_SIZE(coded_size(link,link->max_payload + FCS_MAX_SIZE));
+    if(link->parameters.role == TRANSMITTER) {
+        link->tx_frames = malloc((size_t)link->modulo * frame_size);
+        if(link->tx_frames == NULL || (link->coalesce_delay > 0 && (link->bundle = malloc(link->max_payload)) == NULL))
+            return -1;
+        for(int i = 0; i < link->modulo; i++)
+            link->tx_window[i].frame = link->tx_frames + (size_t)i * frame_size;
+        return 1;
+    }
+    link->rx_frame = malloc(coded_size(link,link->max_payload + FCS_MAX_SIZE));
+    link->rx_bundle = malloc(link->max_payload);
+    if(link->rx_frame == NULL || link->rx_bundle == NULL)
+        return -1;
+    if(link->arq_mode == SELECTIVE_REPEAT && link->window > 1) {
+        link->rx_packets = malloc((size_t)link->modulo * link->max_payload);
+        if(link->rx_packets == NULL)
+            return -1;
+        for(int i = 0; i < link->modulo; i++)
+            link->rx_window[i].packet = link->rx_packets + (size_t)i * link->max_payload;
+    }
+    return 1;
+}
 
-    tcflush(fd, TCIOFLUSH);
+static int send_bundle(linkConnection *link);
 
-    if (tcsetattr(fd,TCSANOW,&newtio) == -1) {
-        perror("tcsetattr");
-        exit(-1);
+/*
+ * Sends the bundle once coalesce_delay passed since its first payload, even if the application calls
+ * the link no more; it holds tx_lock meanwhile, so it never sends while an llwrite() or llflush() runs
+ */
+static void *bundle_timer(void *arg) {
+    linkConnection *link = arg;
+    pthread_mutex_lock(&link->tx_lock);
+    while(!link->timer_stop) {
+        if(link->bundle_count == 0 || link->timer_failed) {
+            pthread_cond_wait(&link->bundle_held,&link->tx_lock);
+            continue;
+        }
+        long long due = link->bundle_since + link->coalesce_delay;
+        if(now_ms() >= due) {
+            if(send_bundle(link) < 0)
+                link->timer_failed = TRUE;
+            continue;
+        }
+        struct timespec deadline = {due / 1000, (due % 1000) * 1000000L};
+        pthread_cond_timedwait(&link->bundle_held,&link->tx_lock,&deadline);
     }
+    pthread_mutex_unlock(&link->tx_lock);
+    return NULL;
+}
 
-    if(connectionParameters.role == 0)
-        send_cframe(A_TX,SET);
+static int start_bundle_timer(linkConnection *link) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC); // the deadline is in now_ms() time
+    pthread_mutex_init(&link->tx_lock,NULL);
+    pthread_cond_init(&link->bundle_held,&attr);
+    pthread_condattr_destroy(&attr);
+    link->timer_stop = link->timer_failed = FALSE;
+    int error = pthread_create(&link->timer_thread,NULL,bundle_timer,link);
+    if(error != 0) {
+        pthread_cond_destroy(&link->bundle_held);
+        pthread_mutex_destroy(&link->tx_lock);
+        errno = error;
+        return -1;
+    }
+    link->timer_running = TRUE;
+    return 1;
+}
 
-    unsigned char byte = 0, address_byte = 0, control_byte = 0;
-    int retrasmission_counter = 0, state = 1;
+// Returns once the timer thread ended, the bundle is left for llflush() to send
+static void stop_bundle_timer(linkConnection *link) {
+    if(!link->timer_running)
+        return;
+    pthread_mutex_lock(&link->tx_lock);
+    link->timer_stop = TRUE;
+    pthread_cond_signal(&link->bundle_held);
+    pthread_mutex_unlock(&link->tx_lock);
+    pthread_join(link->timer_thread,NULL);
+    pthread_cond_destroy(&link->bundle_held);
+    pthread_mutex_destroy(&link->tx_lock);
+    link->timer_running = FALSE;
+}
+
+// The application's calls that send are serialized with the timer only while it runs
+static void tx_lock(linkConnection *link) {
+    if(link->timer_running)
+        pthread_mutex_lock(&link->tx_lock);
+}
+
+static void tx_unlock(linkConnection *link) {
+    if(link->timer_running)
+        pthread_mutex_unlock(&link->tx_lock);
+}
+
+// Closes the port, writes the trace and releases the handle
+static void link_free(linkConnection *link) {
+    stop_bundle_timer(link);
+    if(link->parameters.traceFile[0])
+        trace_save(&link->trace,link->parameters.traceFile);
+    trace_free(&link->trace);
+    transport_close(&link->io);
+    for(int i = 0; i < SEQ_MODULO; i++)
+        free(link->tx_window[i].iov);
+    free(link->tx_frames);
+    free(link->rx_frame);
+    free(link->rx_packets);
+    free(link->bundle);
+    free(link->rx_bundle);
+    free(link->fec);
+    free(link);
+}
+
+/*
+ * Reads the next SET or UA and the parameters it carries (params_size is 0 if there are none)
+ * Returns -1 once the timer expires
+ */
+static int read_pframe(linkConnection *link, unsigned char *address_byte, unsigned char *control_byte, unsigned char *params, int *params_size) {
+    unsigned char byte = 0, raw[2*(PARAMS_MAX_SIZE + 1)];
+    int state = 1, raw_size = 0;
+    *params_size = 0;
     while(state) {
-        if(read_timeout(&byte) < 0) {
-            retrasmission_counter++;
-            if(retrasmission_counter > num_tries)
-                return -1;
-            if(connectionParameters.role == 0)
-                send_cframe(A_TX,SET);
-            state = 1;
-        }
-        #if DEBUG
-        printf("            [%d] <-- %02x\n",state,byte);
-        #endif
+        if(read_timeout(link,&byte) < 0)
+            return -1;
+        TRACE_EVENT(&link->trace,TRACE_BYTES,TRACE_RX_BYTE,state,byte,0,0);
         switch(state) {
             case 1:
                 if(byte == FLAG)
@@ -162,7 +565,7 @@ int llopen(linkLayer connectionParameters) {
             break;
             case 2:
                 if(byte == A_TX || byte == A_RX) {
-                    address_byte = byte;
+                    *address_byte = byte;
                     state = 3;
                 }
                 else if(byte == FLAG)
@@ -172,7 +575,7 @@ int llopen(linkLayer connectionParameters) {
             break;
             case 3:
                 if(byte == SET || byte == UA) {
-                    control_byte = byte;
+                    *control_byte = byte;
                     state = 4;
                 }
                 else if(byte == FLAG)
@@ -181,10 +584,8 @@ int llopen(linkLayer connectionParameters) {
                     state = 1;
             break;
             case 4:
-                #if DEBUG
-                printf("            [%d] received %02x and expected %02x\n",state,byte,address_byte^control_byte);
-                #endif
-                if(byte == (address_byte^control_byte))
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_CHECK,state,byte,*address_byte^*control_byte,0);
+                if(byte == (*address_byte^*control_byte))
                     state = 5;
                 else if(byte == FLAG)
                     state = 2;
@@ -192,90 +593,394 @@ int llopen(linkLayer connectionParameters) {
                     state = 1;
             break;
             case 5:
+                raw_size = 0;
                 if(byte == FLAG) {
-                    if(control_byte == SET) // Answer SET with UA
-                        send_cframe(address_byte,UA);
                     state = 0;
+                    break;
                 }
-                else
+                state = 6;
+                // fall through: first byte of the parameters
+            case 6:
+                if(byte != FLAG) {
+                    if(raw_size < sizeof(raw))
+                        raw[raw_size++] = byte;
+                    else
+                        state = 1;
+                    break;
+                }
+
+                // byte destuffing and BCC2 check of the parameters
+                int size = 0;
+                unsigned char bcc2 = 0;
+                for(int i = 0; i < raw_size && size <= PARAMS_MAX_SIZE; i++) {
+                    unsigned char value = raw[i] == ESC && i + 1 < raw_size ? raw[++i] ^ ESC_XOR : raw[i];
+                    if(size < PARAMS_MAX_SIZE)
+                        params[size] = value;
+                    size++;
+                    bcc2 ^= value;
+                }
+                if(size > 0 && size <= PARAMS_MAX_SIZE && bcc2 == 0) {
+                    *params_size = size - 1;
+                    state = 0;
+                } else {
                     state = 1;
+                }
             break;
         }
     }
-
     return 1;
 }
 
-// Sends data in buf with size bufSize
-int llwrite(unsigned char* buf, int bufSize) {
-    start = time(0);
-    #if DEBUG
-    printf("[linklayer] llwrite() write data to socket\n");
-    #endif
+static int step_encode(unsigned char *params, int step, long rate) {
+    int n = 0;
+    params[n++] = PARAM_STEP;
+    params[n++] = 1;
+    params[n++] = step;
+    params[n++] = PARAM_BAUD;
+    params[n++] = 4;
+    for(int i = 0; i < 4; i++)
+        params[n++] = rate >> (8*i);
+    return n;
+}
 
-    // Populate frame array
-    int frame_size;
-    unsigned char bcc2, frame[FRAME_MAX_SIZE];
-    frame[0] = FLAG;
-    frame[1] = A_TX;
-    frame[2] = s ? I_1 : I_0;
-    frame[3] = frame[1]^frame[2];
+// Reads the step of the rate negotiation in params, returns -1 if they are not one
+static int step_decode(const unsigned char *params, int params_size, int *step, long *rate) {
+    *step = -1;
+    *rate = 0;
+    for(int i = 0; i + 2 <= params_size && i + 2 + params[i+1] <= params_size; i += 2 + params[i+1]) {
+        if(params[i] == PARAM_STEP && params[i+1] == 1)
+            *step = params[i+2];
+        else if(params[i] == PARAM_BAUD)
+            *rate = param_value(&params[i+2],params[i+1]);
+    }
+    return *step >= BAUD_SWITCH && *step <= BAUD_DONE && *rate > 0 ? 1 : -1;
+}
 
-    #if DEBUG
-    printf("            [1] parity %d\n",s);
-    printf("            [1] constructing packet");
-    printf("            [1] %02x %02x %02x %02x --> \n",frame[0],frame[1],frame[2],frame[3]);
-    #endif
+// Rates tried in turn, each one only once the previous one worked
+static const long baud_steps[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000, 1500000, 2000000, 3000000, 4000000};
 
-    frame_size = 4;
-    bcc2 = 0;
-    for(int i = 0; i < bufSize; i++) {
-        bcc2 = bcc2 ^ buf[i]; // The generation of BCC considers only the original octets (before stuffing)
-        bytestuff(buf[i],frame,&frame_size);
-        #if DEBUG
-        if(buf[i] == FLAG || buf[i] == ESC)
-        printf("ESCAPE ");
-        printf("%02x(%02x) ",frame[frame_size - 1], bcc2);
-        if((frame_size - 4) % 16 == 0)
-            printf("\n");
-        #endif
-    }
-
-    #if DEBUG
-    printf("%02x %02x\n",bcc2,FLAG);
-    #endif
-    bytestuff(bcc2,frame,&frame_size);
-    frame[frame_size++] = FLAG;
+// Next rate to try after rate, or 0 once it reached the fastest both ends accept
+static long next_baud(linkConnection *link, long rate) {
+    for(int i = 0; i < sizeof(baud_steps) / sizeof(baud_steps[0]); i++)
+        if(baud_steps[i] > rate && baud_steps[i] < link->max_baud)
+            return baud_steps[i];
+    return rate < link->max_baud ? link->max_baud : 0;
+}
 
-    // Send frame
-    res = write(fd,frame,frame_size);
-    #if DEBUG
-    printf("            [1] sending %d bytes of data\n",frame_size - 6);
-    #endif
+// Sends a step up to tries times, until the UA that echoes it arrives; returns -1 if it never did
+static int baud_exchange(linkConnection *link, int step, long rate, int tries) {
+    unsigned char params[PARAMS_MAX_SIZE], reply[PARAMS_MAX_SIZE], address_byte = 0, control_byte = 0;
+    int params_size = step_encode(params,step,rate), reply_size = 0, reply_step;
+    long reply_rate;
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_BAUD,0,0,step,rate);
+    for(int i = 0; i < tries; i++) {
+        send_pframe(link,A_TX,SET,params,params_size);
+        start_timer(link);
+        while(read_pframe(link,&address_byte,&control_byte,reply,&reply_size) > 0)
+            if(control_byte == UA && step_decode(reply,reply_size,&reply_step,&reply_rate) > 0 && reply_step == step && reply_rate == rate)
+                return 1;
+        link->stats.timeout_counter++;
+    }
+    return -1;
+}
+
+/*
+ * Transmitter side of the rate negotiation: announces each faster rate at the current one and probes it there,
+ * the first probe left unanswered sends it back to the last rate that worked, where it tells the receiver to stay
+ */
+static int raise_baud(linkConnection *link) {
+    long rate;
+    while((rate = next_baud(link,link->baud)) > 0) {
+        if(baud_exchange(link,BAUD_SWITCH,rate,link->num_tries + 1) < 0 || transport_set_baud(&link->io,rate) < 0)
+            break; // a receiver that moved comes back by itself
+        if(baud_exchange(link,BAUD_PROBE,rate,link->num_tries + 1) < 0) {
+            TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_BAUD,0,0,BAUD_FALLBACK,link->baud);
+            transport_set_baud(&link->io,link->baud);
+            break;
+        }
+        link->baud = rate;
+    }
+    // The receiver may still be waiting at the rate that failed, it gives up on it within num_tries + 1 timeouts
+    return baud_exchange(link,BAUD_DONE,link->baud,2*(link->num_tries + 1));
+}
+
+/*
+ * Receiver side of the rate negotiation: answers every step and follows BAUD_SWITCH to the new rate,
+ * which only counts as working once the next step arrives at it; without one in num_tries + 1 timeouts
+ * it goes back to the last rate that worked
+ */
+static int follow_baud(linkConnection *link) {
+    unsigned char params[PARAMS_MAX_SIZE], address_byte = 0, control_byte = 0;
+    int params_size = 0, step;
+    long rate, good = link->baud;
+    while(TRUE) {
+        link->deadline = now_ms() + (link->baud == good ? 2 : 1) * (link->num_tries + 1) * link->time_out * 1000LL;
+        if(read_pframe(link,&address_byte,&control_byte,params,&params_size) < 0) {
+            if(link->baud == good)
+                return -1; // the transmitter gave up
+            TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_BAUD,0,0,BAUD_FALLBACK,good);
+            transport_set_baud(&link->io,good);
+            link->baud = good;
+            continue;
+        }
+        if(control_byte != SET)
+            continue;
+        if(step_decode(params,params_size,&step,&rate) < 0) { // the UA to the SET of llopen() was lost
+            send_pframe(link,address_byte,UA,link->ua_params,link->ua_size);
+            continue;
+        }
+        if(step == BAUD_DONE && rate == good && link->baud != good) { // the transmitter already went back
+            transport_set_baud(&link->io,good);
+            link->baud = good;
+        }
+        if(rate > link->max_baud || (step != BAUD_SWITCH && rate != link->baud))
+            continue;
+
+        link->ua_size = step_encode(link->ua_params,step,rate);
+        send_pframe(link,address_byte,UA,link->ua_params,link->ua_size);
+        TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_BAUD,0,0,step,rate);
+        if(step == BAUD_DONE)
+            return 1;
+        if(step == BAUD_SWITCH && rate != link->baud) {
+            good = link->baud; // the transmitter only moves on once its probe at this rate was answered
+            if(transport_set_baud(&link->io,rate) == 1)
+                link->baud = rate;
+        }
+    }
+}
+
+// Opens a conection using the "port" parameters defined in struct linkLayer, returns the handle of the link or NULL on error
+linkConnection *llopen_link(linkLayer connectionParameters) {
+    linkConnection *link = calloc(1,sizeof(linkConnection));
+    if(link == NULL || trace_init(&link->trace,connectionParameters.traceLevel) < 0) {
+        perror("calloc");
+        free(link);
+        return NULL;
+    }
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_LLOPEN,0,0,0,0);
+    link->parameters = connectionParameters;
+
+    link->time_out = TIMEOUT_DEFAULT;
+    if(connectionParameters.timeOut)
+        link->time_out = connectionParameters.timeOut;
+    link->srtt = link->rttvar = 0;
+    link->rto = link->time_out * 1000LL;
+
+    link->num_tries = MAX_RETRANSMISSIONS_DEFAULT;
+    if(connectionParameters.numTries)
+        link->num_tries = connectionParameters.numTries;
 
-    // Start state machine
+    link->window = WINDOW_SIZE_DEFAULT;
+    if(connectionParameters.windowSize > 0)
+        link->window = connectionParameters.windowSize < MAX_WINDOW_SIZE ? connectionParameters.windowSize : MAX_WINDOW_SIZE;
+    link->arq_mode = connectionParameters.arqMode == SELECTIVE_REPEAT ? SELECTIVE_REPEAT : GO_BACK_N;
+    if(link->arq_mode == SELECTIVE_REPEAT && link->window > SEQ_MODULO/2)
+        link->window = SEQ_MODULO/2;
+    link->fcs = connectionParameters.fcs == FCS_CRC16 || connectionParameters.fcs == FCS_CRC32C ? connectionParameters.fcs : FCS_BCC2;
+    link->max_payload = MAX_PAYLOAD_SIZE;
+    if(connectionParameters.maxPayload > 0)
+        link->max_payload = connectionParameters.maxPayload < MAX_PAYLOAD_LIMIT ? connectionParameters.maxPayload : MAX_PAYLOAD_LIMIT;
+    link->baud = transport_baud(connectionParameters.baudRate ? connectionParameters.baudRate : BAUDRATE_DEFAULT);
+    link->max_baud = connectionParameters.maxBaudRate > 0 ? transport_baud(connectionParameters.maxBaudRate) : 0;
+    link->split = connectionParameters.adaptiveFrames ? TRUE : FALSE;
+    if(connectionParameters.openDataSize < 0 || connectionParameters.openDataSize > OPEN_DATA_MAX)
+        link->parameters.openDataSize = 0;
+    link->peer_data_size = 0;
+    link->coalesce_delay = connectionParameters.coalesceDelay > 0 ? connectionParameters.coalesceDelay : 0;
+    link->bundle_size = link->bundle_count = 0;
+    link->rx_bundle_size = link->rx_bundle_next = 0;
+    link->fec_parity = 0;
+    if(connectionParameters.fecParity > 0) // rounded up to an even number, each wrong byte takes two
+        link->fec_parity = connectionParameters.fecParity < FEC_MAX_PARITY ? (connectionParameters.fecParity + 1) & ~1 : FEC_MAX_PARITY;
+
+    link->tx_base = link->tx_next = 0;
+    link->rx_expected = link->rx_deliver = 0;
+    link->rej_sent = FALSE;
+    for(int i = 0; i < SEQ_MODULO; i++)
+        link->rx_window[i].valid = FALSE;
+
+    link->stats.received_i_frames = 0;
+    link->stats.transmitted_i_frames = 0;
+    link->stats.retransmitted_i_frames = 0;
+    link->stats.received_rej_frames = 0;
+    link->stats.transmitted_rej_frames = 0;
+    link->stats.duplicate_i_frames = 0;
+    link->stats.timeout_counter = 0;
+    link->stats.escaped_bytes = 0;
+    link->stats.transmitted_bytes = 0;
+    link->stats.received_bytes = 0;
+    link->stats.acknowledged_bytes = 0;
+    link->stats.frame_resizes = 0;
+    link->stats.corrected_i_frames = 0;
+    link->stats.corrected_bytes = 0;
+    link->stats.rejected_i_frames = 0;
+    link->stats.coalesced_payloads = 0;
+
+    hist_init(&link->stats.frame_time);
+    hist_init(&link->stats.round_trip);
+    hist_init(&link->stats.ack_time);
+    hist_init(&link->stats.retransmit_delay);
+
+    if(transport_open(&link->io,connectionParameters.serialPort,link->baud) < 0) {
+        trace_free(&link->trace);
+        free(link);
+        return NULL;
+    }
+    link->rx_head = link->rx_tail = 0;
+
+    // Stop-and-Wait with BCC2 and default sized frames needs no negotiation, so a plain SET is sent as before
+    unsigned char params[PARAMS_MAX_SIZE], peer_params[PARAMS_MAX_SIZE], address_byte = 0, control_byte = 0;
+    int negotiate = link->window > 1 || link->fcs != FCS_BCC2 || link->max_payload != MAX_PAYLOAD_SIZE || link->max_baud > link->baud || link->split || link->fec_parity || link->coalesce_delay || link->parameters.openDataSize > 0;
+    int params_size = negotiate ? params_encode(link,params) : 0, peer_size = 0;
+    if(connectionParameters.role == 0)
+        send_pframe(link,A_TX,SET,params,params_size);
+    start_timer(link);
+
+    int retrasmission_counter = 0;
+    while(read_pframe(link,&address_byte,&control_byte,peer_params,&peer_size) < 0) {
+        retrasmission_counter++;
+        if(retrasmission_counter > link->num_tries) {
+            link_free(link);
+            return NULL;
+        }
+        if(connectionParameters.role == 0)
+            send_pframe(link,A_TX,SET,params,params_size);
+        start_timer(link);
+    }
+    if(peer_size > 0)
+        params_decode(link,peer_params,peer_size);
+
+    if(peer_size == 0) { // the peer does not negotiate parameters
+        link->window = 1;
+        link->fcs = FCS_BCC2;
+        link->max_payload = MAX_PAYLOAD_SIZE;
+        link->max_baud = 0;
+        link->split = FALSE;
+        link->fec_parity = 0;
+        link->coalesce_delay = 0;
+    }
+    if(control_byte == SET) { // Answer SET with UA
+        link->ua_size = peer_size ? params_encode(link,link->ua_params) : 0;
+        send_pframe(link,address_byte,UA,link->ua_params,link->ua_size);
+    }
+
+    link->modulo = link->window > 1 ? SEQ_MODULO : 2;
+    link->fcs_size = link->fcs == FCS_CRC32C ? 4 : link->fcs == FCS_CRC16 ? 2 : 1;
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_PARAMS,link->fcs_size,link->arq_mode,link->window,link->max_payload);
+    link->frame_payload = link->stats.smallest_frame_payload = link->max_payload;
+    link->sizing_frames = link->sizing_errors = 0;
+    link->sizing_bytes = 0;
+    if(alloc_buffers(link) < 0) {
+        perror("malloc");
+        link_free(link);
+        return NULL;
+    }
+    if(link->max_baud > link->baud && (connectionParameters.role == TRANSMITTER ? raise_baud(link) : follow_baud(link)) < 0) {
+        link_free(link);
+        return NULL;
+    }
+    if(link->bundle != NULL && start_bundle_timer(link) < 0) {
+        perror("pthread_create");
+        link_free(link);
+        return NULL;
+    }
+
+    link->stats.open_time = now_ns();
+    return link;
+}
+
+static int outstanding(linkConnection *link) {
+    return (link->tx_next - link->tx_base + link->modulo) % link->modulo;
+}
+
+// Appends a buffer to the frame in slot n, bytes right after the last one extend it; returns -1 if there is not enough memory
+static int add_iov(linkConnection *link, int n, const unsigned char *data, int size) {
+    if(size == 0)
+        return 1;
+    if(link->tx_window[n].iov_count > 0) {
+        struct iovec *last = &link->tx_window[n].iov[link->tx_window[n].iov_count - 1];
+        if((unsigned char *)last->iov_base + last->iov_len == data) {
+            last->iov_len += size;
+            return 1;
+        }
+    }
+    if(link->tx_window[n].iov_count == link->tx_window[n].iov_capacity) {
+        int capacity = link->tx_window[n].iov_capacity ? 2*link->tx_window[n].iov_capacity : 16;
+        struct iovec *iov = realloc(link->tx_window[n].iov,capacity * sizeof(struct iovec));
+        if(iov == NULL)
+            return -1;
+        link->tx_window[n].iov = iov;
+        link->tx_window[n].iov_capacity = capacity;
+    }
+    link->tx_window[n].iov[link->tx_window[n].iov_count].iov_base = (void *)data;
+    link->tx_window[n].iov[link->tx_window[n].iov_count++].iov_len = size;
+    return 1;
+}
+
+// Writes the frame in slot n, IOV_MAX buffers at a time
+static void send_slot(linkConnection *link, int n) {
+    link->sizing_frames++;
+    link->sizing_bytes += link->tx_window[n].size;
+    for(int i = 0; i < link->tx_window[n].iov_count; i += IOV_MAX) {
+        int count = link->tx_window[n].iov_count - i;
+        transport_writev(&link->io,&link->tx_window[n].iov[i],count < IOV_MAX ? count : IOV_MAX);
+    }
+}
+
+static void retransmit(linkConnection *link, int first, int count) {
+    for(int i = 0, n = first; i < count; i++, n = (n + 1) % link->modulo) {
+        send_slot(link,n);
+        uint64_t now = now_ns();
+        hist_record(&link->stats.retransmit_delay,now - link->tx_window[n].last_sent);
+        link->tx_window[n].last_sent = now;
+        link->tx_window[n].retransmitted = TRUE;
+        link->stats.transmitted_i_frames++;
+        link->stats.retransmitted_i_frames++;
+        TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_RETRANSMIT,0,0,n,link->tx_window[n].size - 6);
+    }
+    start_rto_timer(link);
+}
+
+/*
+ * Records the latencies of the count oldest frames in the window, which the receiver just acknowledged
+ * Only the newest one was acknowledged by its own RR and a retransmitted one cannot tell which
+ * transmission the RR answers, so the others give no round trip
+ */
+static void acknowledged(linkConnection *link, int count) {
+    uint64_t now = now_ns();
+    for(int i = 0, n = link->tx_base; i < count; i++, n = (n + 1) % link->modulo) {
+        hist_record(&link->stats.ack_time,now - link->tx_window[n].sent);
+        if(i == count - 1 && !link->tx_window[n].retransmitted) {
+            hist_record(&link->stats.round_trip,now - link->tx_window[n].last_sent);
+            rtt_sample(link,now - link->tx_window[n].last_sent);
+        }
+        link->stats.acknowledged_bytes += link->tx_window[n].payload;
+    }
+}
+
+/*
+ * Reads one RR/REJ and slides the window, retransmitting on REJ or timeout
+ * RR(n) acknowledges every frame up to n, REJ(n) asks for frame n again
+ * (and every frame after it with Go-Back-N)
+ * Retransmissions are counted per frame, so REJs of different frames do not add up,
+ * and timeouts shorter than time_out only double the timer: a frame is given up on
+ * after numTries retransmissions asked by REJ or at the full timeOut
+ * Returns -1 once numTries retransmissions of a frame were not enough
+ */
+static int await_ack(linkConnection *link) {
     int state = 1;
-    int retransmission_counter = 0;
     unsigned char byte = 0, address_byte = 0, control_byte = 0;
     while(state) {
-        if(read_timeout(&byte) < 0) {
-            retransmission_counter++;
-            if(retransmission_counter > num_tries) {
-                stats.total_time += end - start;
-                if(end - start > stats.slowest_frame)
-                    stats.slowest_frame = end - start;
-                if(end - start < stats.fastest_frame)
-                    stats.fastest_frame = end - start;
+        if(read_timeout(link,&byte) < 0) {
+            link->stats.timeout_counter++;
+            link->sizing_errors++;
+            int backed_off = link->rto >= link->time_out * 1000LL;
+            link->rto = 2 * link->rto < link->time_out * 1000LL ? 2 * link->rto : link->time_out * 1000LL;
+            TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_TIMEOUT,0,0,link->tx_window[link->tx_base].retries + 1,link->rto);
+            if(backed_off && ++link->tx_window[link->tx_base].retries > link->num_tries)
                 return -1;
-            }
-
-            res = write(fd,frame,frame_size);
-            stats.transmitted_i_frames++;
-            #if DEBUG
-            printf("            [%d] Retransmitting %d bytes of data\n",state, frame_size - 6);
-            #endif
-
-            state = 1;
+            retransmit(link,link->tx_base, link->arq_mode == SELECTIVE_REPEAT ? 1 : outstanding(link));
+            return 0;
         }
         switch(state) {
             case 1:
@@ -293,38 +998,17 @@ int llwrite(unsigned char* buf, int bufSize) {
                     state = 1;
             break;
             case 3:
-                if(byte == FLAG) {
-                    state = 2;
-                    break;
-                }
-
-                if(byte == (frame[2] == I_0 ? RR_0 : RR_1)) {
+                if(IS_RR(byte) || IS_REJ(byte)) {
                     control_byte = byte;
                     state = 4;
                 }
-                else if(byte == (frame[2] == I_0 ? REJ_0 : REJ_1)) {
-                    stats.received_rej_frames++;
-                    // TODO: Retransmit only after receiving the full control packet
-                    control_byte = byte;
-                    retransmission_counter++;
-                    if(retransmission_counter > num_tries)
-                        return -1;
-
-                    res = write(fd,frame,frame_size);
-                    stats.transmitted_i_frames++;
-                    #if DEBUG
-                    printf("            [%d] Retransmitting %d bytes of data\n",state, frame_size - 6);
-                    #endif
-
-                    state = 1;
-                } else {
+                else if(byte == FLAG)
+                    state = 2;
+                else
                     state = 1;
-                }
             break;
             case 4:
-                #if DEBUG
-                printf("            [%d] received %02x and expected %02x\n",state,byte,address_byte^control_byte);
-                #endif
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_CHECK,state,byte,address_byte^control_byte,0);
                 if(byte == (address_byte^control_byte))
                     state = 5;
                 else if(byte == FLAG)
@@ -333,43 +1017,431 @@ int llwrite(unsigned char* buf, int bufSize) {
                     state = 1;
             break;
             case 5:
-                if(byte == FLAG) {
-                    s = !s; // change parity
+                if(byte == FLAG)
                     state = 0;
-                }
                 else
                     state = 1;
             break;
         }
     }
 
-    stats.transmitted_bytes += frame_size - 2;
-    end = time(0);
-    stats.total_time += end - start;
-    if(end - start > stats.slowest_frame)
-        stats.slowest_frame = end - start;
-    if(end - start < stats.fastest_frame)
-        stats.fastest_frame = end - start;
+    int n = R_SEQ(control_byte) % link->modulo;
+    if(IS_RR(control_byte)) {
+        int acked = (n - link->tx_base + link->modulo) % link->modulo + 1;
+        if(acked <= outstanding(link)) { // ignore acknowledgements of frames that already left the window
+            acknowledged(link,acked);
+            link->tx_base = (n + 1) % link->modulo;
+            if(outstanding(link) > 0) // the timer now runs for the oldest frame still unacknowledged
+                start_rto_timer(link);
+        }
+        return 0;
+    }
+
+    link->stats.received_rej_frames++;
+    link->sizing_errors++;
+    int rejected = (n - link->tx_base + link->modulo) % link->modulo;
+    if(rejected >= outstanding(link))
+        return 0;
+    if(++link->tx_window[n].retries > link->num_tries)
+        return -1;
+    if(link->arq_mode == SELECTIVE_REPEAT) {
+        retransmit(link,n, 1);
+    } else {
+        acknowledged(link,rejected);
+        link->tx_base = n; // REJ(n) also acknowledges every frame before n
+        retransmit(link,n, outstanding(link));
+    }
+    return 0;
+}
+
+// Sends the frame built in the next slot; returns once it fits in the transmission window
+static int send_iframe(linkConnection *link) {
+    int frame_size = link->tx_window[link->tx_next].size;
+    send_slot(link,link->tx_next);
+    link->tx_window[link->tx_next].sent = link->tx_window[link->tx_next].last_sent = now_ns();
+    link->tx_window[link->tx_next].retransmitted = FALSE;
+    link->tx_window[link->tx_next].retries = 0;
+    link->stats.transmitted_i_frames++;
+    if(outstanding(link) == 0)
+        start_rto_timer(link);
+    link->tx_next = (link->tx_next + 1) % link->modulo;
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_SEND_IFRAME,1,0,outstanding(link),frame_size - 6);
+
+    // Only block while the window is full (with Stop-and-Wait, until this frame is acknowledged)
+    while(outstanding(link) >= link->window) {
+        if(await_ack(link) < 0) {
+            hist_record(&link->stats.frame_time,now_ns() - link->start);
+            return -1;
+        }
+    }
+
+    link->stats.transmitted_bytes += frame_size - 2;
+    hist_record(&link->stats.frame_time,now_ns() - link->start);
     return 1;
+}
+
+static long long isqrt(long long x) {
+    long long root = x, next = (x + 1) / 2;
+    while(next < root) {
+        root = next;
+        next = (root + x / root) / 2;
+    }
+    return root;
+}
+
+/*
+ * Chooses the payload of the next I frames once SIZING_FRAMES frames were sent or SIZING_ERRORS errors seen since the last choice
+ * With a bit error rate b, a frame of L payload bytes and h bytes of header, FCS and flags arrives intact
+ * with probability (1-b)^8(L+h), so the share of the line carrying good payload, L/(L+h) (1-b)^8(L+h),
+ * is largest at L = (sqrt(h^2 + h/2b) - h) / 2, with b estimated as the REJs and timeouts per bit sent
+ * The payload at most doubles at each choice, so a clean line brings it back to max_payload in a few steps
+ */
+static void size_frames(linkConnection *link) {
+    if(!link->split || (link->sizing_frames < SIZING_FRAMES && link->sizing_errors < SIZING_ERRORS))
+        return;
+    long long overhead = 5 + link->fcs_size, payload = 2LL * link->frame_payload;
+    if(link->sizing_errors > 0) { // h/2b = h * 8 * bytes / (2 * errors)
+        long long best = (isqrt(overhead * overhead + 4 * overhead * link->sizing_bytes / link->sizing_errors) - overhead) / 2;
+        payload = best < payload ? best : payload;
+    }
+    payload = payload < MIN_FRAME_PAYLOAD ? MIN_FRAME_PAYLOAD : payload;
+    payload = payload > link->max_payload ? link->max_payload : payload;
+    if(payload != link->frame_payload) {
+        link->frame_payload = payload;
+        link->stats.frame_resizes++;
+        if(payload < link->stats.smallest_frame_payload)
+            link->stats.smallest_frame_payload = payload;
+        TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_FRAME_SIZE,0,0,link->sizing_errors > 255 ? 255 : link->sizing_errors,payload);
+    }
+    link->sizing_frames = link->sizing_errors = 0;
+    link->sizing_bytes = 0;
+}
+
+// Stuffs the parity of the codeword in remainder and starts a new one
+static int fec_flush(linkConnection *link, unsigned char *frame, unsigned char *remainder, int *filled) {
+    unsigned char parity_bcc = 0; // the BCC2 only covers the data
+    int size = stuff(remainder,link->fec_parity,frame,&parity_bcc,&link->stats.escaped_bytes);
+    memset(remainder,0,FEC_MAX_PARITY);
+    *filled = 0;
+    return size;
+}
+
+// Stuffs size bytes to frame as part of the codewords, with the parity after every FEC_DATA bytes; returns the bytes written
+static int fec_stuff(linkConnection *link, unsigned char *frame, const unsigned char *data, int size, unsigned char *bcc2, unsigned char *remainder, int *filled) {
+    int written = 0;
+    while(size > 0) {
+        int chunk = FEC_DATA(link->fec_parity) - *filled < size ? FEC_DATA(link->fec_parity) - *filled : size;
+        fec_encode(link->fec,remainder,data,chunk);
+        written += stuff(data,chunk,frame + written,bcc2,&link->stats.escaped_bytes);
+        data += chunk;
+        size -= chunk;
+        *filled += chunk;
+        if(*filled == FEC_DATA(link->fec_parity))
+            written += fec_flush(link,frame + written,remainder,filled);
+    }
+    return written;
+}
+
+// Builds the frame of a payload gathered from iovcnt buffers with FEC, which is always copied to the frame, and sends it
+static int write_fec_frame(linkConnection *link, const struct iovec *iov, int iovcnt, int payload_size, int flags) {
+    int n = link->tx_next, frame_size = 0, filled = 0;
+    unsigned char bcc2 = 0, remainder[FEC_MAX_PARITY] = {0}, fcs_bytes[FCS_MAX_SIZE], *frame = link->tx_window[n].frame;
+    frame[frame_size++] = FLAG;
+    frame[frame_size++] = A_TX;
+    frame[frame_size++] = I_CTRL(n) | flags;
+    frame[frame_size++] = frame[1]^frame[2];
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_TX_HEADER,1,frame[2],n,frame[1]);
+
+    for(int i = 0; i < iovcnt; i++)
+        frame_size += fec_stuff(link,&frame[frame_size],iov[i].iov_base,iov[i].iov_len,&bcc2,remainder,&filled);
+    fcs_encode(link,iov,iovcnt,bcc2,fcs_bytes);
+    frame_size += fec_stuff(link,&frame[frame_size],fcs_bytes,link->fcs_size,&bcc2,remainder,&filled);
+    if(filled > 0) // the last codeword is shortened
+        frame_size += fec_flush(link,&frame[frame_size],remainder,&filled);
+    frame[frame_size++] = FLAG;
+
+    link->tx_window[n].size = frame_size;
+    link->tx_window[n].payload = payload_size;
+    link->tx_window[n].iov_count = 0;
+    if(add_iov(link,n,frame,frame_size) < 0)
+        return -1;
+    return send_iframe(link);
+}
+
+// Builds the frame of size bytes of buf in the next slot and sends it; flags are I_MORE for a payload that goes on in the next frame and I_BUNDLE
+static int write_frame(linkConnection *link, unsigned char* buf, int bufSize, int flags) {
+    if(link->fec != NULL) {
+        struct iovec data = {buf, bufSize};
+        return write_fec_frame(link,&data,1,bufSize,flags);
+    }
+
+    // Populate the frame array kept in the window until it is acknowledged
+    int frame_size;
+    unsigned char bcc2, *frame = link->tx_window[link->tx_next].frame;
+    frame[0] = FLAG;
+    frame[1] = A_TX;
+    frame[2] = I_CTRL(link->tx_next) | flags;
+    frame[3] = frame[1]^frame[2];
+
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_TX_HEADER,1,frame[2],link->tx_next,frame[1]);
+
+    frame_size = 4;
+    bcc2 = 0; // The generation of BCC considers only the original octets (before stuffing)
+    frame_size += stuff(buf,bufSize,&frame[frame_size],&bcc2,&link->stats.escaped_bytes);
+
+    if(link->trace.level >= TRACE_BYTES)
+        for(int i = 0; i < bufSize; i++)
+            trace_record(&link->trace,TRACE_TX_DATA,1,buf[i],0,i);
+    TRACE_EVENT(&link->trace,TRACE_BYTES,TRACE_TX_END,1,bcc2,0,0);
+    unsigned char fcs_bytes[FCS_MAX_SIZE];
+    struct iovec data = {buf, bufSize};
+    fcs_encode(link,&data,1,bcc2,fcs_bytes);
+    frame_size += stuff(fcs_bytes,link->fcs_size,&frame[frame_size],&bcc2,&link->stats.escaped_bytes);
+    frame[frame_size++] = FLAG;
+    link->tx_window[link->tx_next].size = frame_size;
+    link->tx_window[link->tx_next].payload = bufSize;
+    link->tx_window[link->tx_next].iov_count = 0;
+    if(add_iov(link,link->tx_next,frame,frame_size) < 0)
+        return -1;
+
+    return send_iframe(link);
+}
+
+// Sends a payload with the given flags in as many frames as the frame size chosen for the line takes, llread() joins them
+static int write_payload(linkConnection *link, unsigned char* buf, int bufSize, int flags) {
+    int sent = 0;
+    do {
+        size_frames(link);
+        int size = link->split && bufSize - sent > link->frame_payload ? link->frame_payload : bufSize - sent;
+        if(write_frame(link,buf + sent,size,flags | (sent + size < bufSize ? I_MORE : 0)) < 0)
+            return -1;
+        sent += size;
+    } while(sent < bufSize);
+    return 1;
+}
+
+// Sends the payloads held in the bundle, a lone one in a frame of its own without its length
+static int send_bundle(linkConnection *link) {
+    int count = link->bundle_count, size = link->bundle_size;
+    link->bundle_count = link->bundle_size = 0;
+    if(count == 0)
+        return 1;
+    if(count == 1)
+        return write_payload(link,link->bundle + BUNDLE_HEADER,size - BUNDLE_HEADER,0);
+    link->stats.coalesced_payloads += count;
+    return write_payload(link,link->bundle,size,I_BUNDLE);
+}
+
+/*
+ * With coalesce_delay, payloads up to half a frame wait in the bundle for the next ones (Nagle): the bundle goes out
+ * when a payload does not fit, once the delay passed since it started (from bundle_timer() if no llwrite() comes),
+ * or when the link is flushed or closed. Larger payloads go after the bundle, keeping the order
+ * Returns 1 if the payload is held (or sent with the bundle), 0 if it must be sent on its own, -1 if the link fails
+ */
+static int coalesce(linkConnection *link, const struct iovec *iov, int iovcnt, int payload_size) {
+    int capacity = link->split ? link->frame_payload : link->max_payload;
+    if(link->bundle == NULL || BUNDLE_HEADER + payload_size > capacity / 2)
+        return send_bundle(link) < 0 ? -1 : 0;
+    if(link->bundle_size + BUNDLE_HEADER + payload_size > capacity && send_bundle(link) < 0)
+        return -1;
+    if(link->bundle_count == 0) {
+        link->bundle_since = now_ms();
+        if(link->timer_running)
+            pthread_cond_signal(&link->bundle_held);
+    }
+    unsigned char *held = &link->bundle[link->bundle_size];
+    *held++ = payload_size >> 8;
+    *held++ = payload_size;
+    for(int i = 0; i < iovcnt; i++) {
+        memcpy(held,iov[i].iov_base,iov[i].iov_len);
+        held += iov[i].iov_len;
+    }
+    link->bundle_size += BUNDLE_HEADER + payload_size;
+    link->bundle_count++;
+    return now_ms() - link->bundle_since >= link->coalesce_delay ? send_bundle(link) : 1;
+}
+
+static int write_buffer(linkConnection *link, unsigned char* buf, int bufSize) {
+    link->start = now_ns();
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_LLWRITE,0,0,0,0);
+    if(bufSize > link->max_payload || link->tx_frames == NULL)
+        return -1;
+
+    struct iovec data = {buf, bufSize};
+    int held = coalesce(link,&data,1,bufSize);
+    return held != 0 ? held : write_payload(link,buf,bufSize,0);
+}
+
+// Sends data in buf with size bufSize; returns once the frame fits in the transmission window
+int llwrite_link(linkConnection *link, unsigned char* buf, int bufSize) {
+    tx_lock(link);
+    int result = link->timer_failed ? -1 : write_buffer(link,buf,bufSize);
+    tx_unlock(link);
+    return result;
 };
 
-// Receive data in packet
-int llread(unsigned char* packet) {
-    start = time(0);
-    #if DEBUG
-    printf("[linklayer] llread() reading socket data\n");
-    #endif
-    int res;
+// Same as write_frame() for payload_size bytes gathered from iovcnt buffers
+static int writev_frame(linkConnection *link, const struct iovec *iov, int iovcnt, int payload_size, int flags) {
+    if(link->fec != NULL)
+        return write_fec_frame(link,iov,iovcnt,payload_size,flags);
+
+    // The frame buffer only holds what is not in the caller's buffers
+    int n = link->tx_next, used = 0, frame_size = 0, failed = 0;
+    unsigned char bcc2 = 0, *scratch = link->tx_window[n].frame, control = I_CTRL(n) | flags;
+    scratch[used++] = FLAG;
+    scratch[used++] = A_TX;
+    scratch[used++] = control;
+    scratch[used++] = A_TX^control;
+    link->tx_window[n].iov_count = 0;
+    failed |= add_iov(link,n,scratch,used) < 0;
+
+    for(int i = 0; i < iovcnt; i++) {
+        const unsigned char *data = iov[i].iov_base;
+        int left = iov[i].iov_len;
+        while(left > 0) {
+            int run = clean_run(data,left,&bcc2);
+            failed |= add_iov(link,n,data,run) < 0;
+            data += run;
+            left -= run;
+            if(left > 0) { // FLAG or ESC
+                bcc2 ^= *data;
+                scratch[used] = ESC;
+                scratch[used + 1] = *data ^ ESC_XOR;
+                failed |= add_iov(link,n,&scratch[used],2) < 0;
+                used += 2;
+                frame_size++;
+                link->stats.escaped_bytes++;
+                data++;
+                left--;
+            }
+        }
+    }
+    frame_size += payload_size + 4;
+
+    unsigned char fcs_bytes[FCS_MAX_SIZE];
+    fcs_encode(link,iov,iovcnt,bcc2,fcs_bytes);
+    int trailer = stuff(fcs_bytes,link->fcs_size,&scratch[used],&bcc2,&link->stats.escaped_bytes);
+    scratch[used + trailer++] = FLAG;
+    failed |= add_iov(link,n,&scratch[used],trailer) < 0;
+    link->tx_window[n].size = frame_size + trailer;
+    link->tx_window[n].payload = payload_size;
+    if(failed)
+        return -1;
+
+    return send_iframe(link);
+}
+
+// Points piece at the next size bytes of iov from buffer *index, offset *offset, and moves past them; returns the buffers used
+static int iov_slice(const struct iovec *iov, int *index, size_t *offset, int size, struct iovec *piece) {
+    int count = 0;
+    while(size > 0) {
+        size_t length = iov[*index].iov_len - *offset;
+        length = length < size ? length : size;
+        if(length > 0) {
+            piece[count].iov_base = (unsigned char *)iov[*index].iov_base + *offset;
+            piece[count++].iov_len = length;
+        }
+        *offset += length;
+        size -= length;
+        if(*offset == iov[*index].iov_len) {
+            (*index)++;
+            *offset = 0;
+        }
+    }
+    return count;
+}
+
+/*
+ * Same as llwrite_link() for a payload gathered from iovcnt buffers, which are not copied:
+ * clean runs are written straight from them, so they must stay unchanged until the frame is acknowledged
+ */
+static int write_buffers(linkConnection *link, const struct iovec *iov, int iovcnt) {
+    link->start = now_ns();
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_LLWRITEV,0,0,0,0);
+    int payload_size = 0;
+    for(int i = 0; i < iovcnt; i++)
+        payload_size += iov[i].iov_len;
+    if(payload_size > link->max_payload || link->tx_frames == NULL)
+        return -1;
+    int held = coalesce(link,iov,iovcnt,payload_size); // small payloads are copied to the bundle
+    if(held != 0)
+        return held;
+
+    size_frames(link);
+    if(!link->split || payload_size <= link->frame_payload)
+        return writev_frame(link,iov,iovcnt,payload_size,0);
+
+    // Split like llwrite_link(), each frame points at its part of the caller's buffers
+    struct iovec *piece = malloc(iovcnt * sizeof(struct iovec));
+    if(piece == NULL)
+        return -1;
+    int sent = 0, index = 0, result = 1;
+    size_t offset = 0;
+    while(sent < payload_size && result > 0) {
+        if(sent > 0)
+            size_frames(link);
+        int size = payload_size - sent > link->frame_payload ? link->frame_payload : payload_size - sent;
+        int count = iov_slice(iov,&index,&offset,size,piece);
+        result = writev_frame(link,piece,count,size,sent + size < payload_size ? I_MORE : 0);
+        sent += size;
+    }
+    free(piece);
+    return result;
+}
+
+int llwritev_link(linkConnection *link, const struct iovec *iov, int iovcnt) {
+    tx_lock(link);
+    int result = link->timer_failed ? -1 : write_buffers(link,iov,iovcnt);
+    tx_unlock(link);
+    return result;
+}
+
+
+/*
+ * Corrects the codewords of a destuffed frame and moves their data together at its start, dropping the parity
+ * Returns the bytes of payload and FCS, or -1 if a codeword has more errors than its parity can correct
+ */
+static int fec_correct(linkConnection *link, unsigned char *frame, int size, int *corrected) {
+    int parity = link->fec_parity, data_size = 0;
+    for(int i = 0; i < size; i += FEC_BLOCK) {
+        int block = size - i < FEC_BLOCK ? size - i : FEC_BLOCK;
+        int fixed = fec_decode(link->fec,frame + i,block);
+        if(fixed < 0)
+            return -1;
+        *corrected += fixed;
+        memmove(frame + data_size,frame + i,block - parity);
+        data_size += block - parity;
+    }
+    return data_size;
+}
+
+// Receives the payload of the next frame in packet, which has room for space bytes; flags are set to its I_MORE and I_BUNDLE
+static int read_frame(linkConnection *link, unsigned char* packet, int space, int *flags) {
     size_t frame_size = 0;
-    unsigned char frame[FRAME_MAX_SIZE];
+    int payload_size = 0;
+    unsigned char *frame = link->rx_frame;
+    if(frame == NULL)
+        return -1;
+
+    // Frames that arrived ahead of a lost one were already acknowledged, deliver them first
+    if(link->rx_deliver != link->rx_expected) {
+        payload_size = link->rx_window[link->rx_deliver].size;
+        if(payload_size > space)
+            return -1;
+        memcpy(packet, link->rx_window[link->rx_deliver].packet, payload_size);
+        *flags = link->rx_window[link->rx_deliver].flags;
+        link->rx_window[link->rx_deliver].valid = FALSE;
+        link->rx_deliver = (link->rx_deliver + 1) % link->modulo;
+        link->stats.received_bytes += payload_size;
+        return payload_size;
+    }
 
     unsigned char byte = 0, address_byte = 0, control_byte = 0;
     int state = 1;
     while(state) {
-        read(fd,&byte,1);
-        #if DEBUG
-        printf("            [%d] <-- %02x\n",state,byte);
-        #endif
+        if(read_byte(link,&byte) < 0) // the port failed or the peer closed it
+            return -1;
+        TRACE_EVENT(&link->trace,TRACE_BYTES,TRACE_RX_BYTE,state,byte,0,0);
         switch(state) {
             case 1:
                 if(byte == FLAG)
@@ -386,7 +1458,7 @@ int llread(unsigned char* packet) {
                     state = 1;
             break;
             case 3:
-                if( ((s == 0) && (byte == I_0)) || ((s == 1) && (byte == I_1)) ) {
+                if(IS_I(byte) || byte == SET) {
                     control_byte = byte;
                     state = 4;
                 }
@@ -401,110 +1473,338 @@ int llread(unsigned char* packet) {
                     break;
                 }
 
-                #if DEBUG
-                printf("            [%d] received %02x and expected %02x\n",state,byte,address_byte^control_byte);
-                #endif
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_CHECK,state,byte,address_byte^control_byte,0);
 
                 if(byte != (address_byte^control_byte)) {
                     state = 1;
                     break;
                 }
 
-                #if DEBUG
-                bcc2_tracker = 0;
-                printf("            [%d] reading frame\n",state);
-                #endif
-                for(frame_size = 0; frame_size < FRAME_MAX_SIZE; frame_size++) {
-                    read(fd,&frame[frame_size],1);
-                    #if RANDOM_ERROR_GENERATION
-                    if(rand() % 200 == 0) {
-                        frame[frame_size] ^ 0x01; // Jam the first bit
-                    }
-                    #endif
-                    if(frame[frame_size] == ESC) { // byte destuffing (note that this also destuff bcc2)
-                        stats.escaped_bytes++;
-                        #if DEBUG
-                        printf("ESCAPE ");
-                        #endif
-                        res = read(fd,&frame[frame_size],1);
-                        frame[frame_size] ^= ESC_XOR;
-                    } else if(frame[frame_size] == FLAG) { // end-of-frame
-                        #if DEBUG
-                        printf("%02x \n",FLAG);
-                        #endif
+                if(control_byte == SET) { // the transmitter missed the UA that ended llopen()
+                    for(int i = 0; i < 2*(PARAMS_MAX_SIZE + 1) && read_byte(link,&byte) > 0 && byte != FLAG; i++)
+                        ;
+                    send_pframe(link,address_byte,UA,link->ua_params,link->ua_size);
+                    state = 1;
+                    break;
+                }
+
+                // Destuff straight from the receive buffer, the BCC2 is folded in the same pass
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_RX_FRAME,state,0,0,0);
+                destuffState destuffing = {0};
+                int coded = coded_size(link,link->max_payload + link->fcs_size);
+                while(!destuffing.done && destuffing.size < coded) {
+                    if(link->rx_head == link->rx_tail && fill_rx_buffer(link) <= 0)
                         break;
-                    }
+                    unsigned int offset = link->rx_tail & (RX_BUFFER_SIZE - 1);
+                    unsigned int contiguous = RX_BUFFER_SIZE - offset < link->rx_head - link->rx_tail ? RX_BUFFER_SIZE - offset : link->rx_head - link->rx_tail;
+                    link->rx_tail += destuff(&link->rx_buffer[offset],contiguous,frame,coded,&destuffing);
+                }
+                frame_size = destuffing.size;
+                link->stats.escaped_bytes += destuffing.escaped;
+                link->stats.received_i_frames++;
 
-                    #if DEBUG
-                    bcc2_tracker ^= frame[frame_size];
-                    printf("%02x(%02x) ",frame[frame_size],bcc2_tracker);
-                    if((frame_size - 4) % 16 == 0)
-                        printf("\n");
-                    #endif
+                if(link->trace.level >= TRACE_BYTES)
+                    for(int i = 0; i < frame_size; i++)
+                        trace_record(&link->trace,TRACE_RX_DATA,state,frame[i],0,i);
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_RX_END,state,frame_size > 0 ? destuffing.bcc ^ frame[frame_size - 1] : 0,frame_size > 0 ? frame[frame_size - 1] : 0,frame_size);
+
+                int ns = I_SEQ(control_byte) % link->modulo, offset = (ns - link->rx_expected + link->modulo) % link->modulo;
+                int corrected = 0;
+                if(link->fec != NULL) { // the FCS is checked on the corrected data, an uncorrectable frame is left empty to fail it
+                    int decoded = fec_correct(link,frame,frame_size,&corrected);
+                    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_FEC,state,0,ns,decoded < 0 ? -1 : corrected);
+                    frame_size = decoded < 0 ? 0 : decoded;
+                    destuffing.bcc = 0;
+                    for(int i = 0; i < frame_size; i++)
+                        destuffing.bcc ^= frame[i];
                 }
-                #if DEBUG
-                printf("\n            [%d] finished reading frame\n",state);
-                #endif
-                stats.received_i_frames++;
-                unsigned char bcc2_local = 0;
-                for(int i = 0; i < frame_size - 1; i++) {
-                    bcc2_local ^= frame[i];
+                state = 1;
+                payload_size = frame_size - link->fcs_size;
+                int intact = fcs_check(link,frame,frame_size,destuffing.bcc);
+                if(!intact) {
+                    link->stats.rejected_i_frames++;
+                } else if(corrected > 0) {
+                    link->stats.corrected_i_frames++;
+                    link->stats.corrected_bytes += corrected;
                 }
-                #if DEBUG
-                printf("            [%d] received %02x and expected %02x\n",state,bcc2_local, frame[frame_size - 1]);
-                #endif
-
-                if(frame[frame_size - 1] == bcc2_local) {
-                    control_byte = s ? RR_1 : RR_0;
-                    s = !s; // change parity
-                    for(int i = 0; i < frame_size - 1; i++)
+                if(!intact) {
+                    // the header is intact, ask for this frame again (Go-Back-N can only reject the expected one)
+                    if(offset == 0 || (link->arq_mode == SELECTIVE_REPEAT && offset < link->window)) {
+                        link->stats.transmitted_rej_frames++;
+                        send_cframe(link,address_byte,REJ_CTRL(ns));
+                    }
+                    if(offset == 0) // frames right behind it must not reject it a second time
+                        link->rej_sent = TRUE;
+                } else if(offset == 0) {
+                    if(payload_size > space) // longer than the payload llwrite() accepts
+                        return -1;
+                    for(int i = 0; i < payload_size; i++)
                         packet[i] = frame[i];
+                    *flags = control_byte & (I_MORE | I_BUNDLE);
+                    link->rx_expected = link->rx_deliver = (link->rx_expected + 1) % link->modulo;
+                    while(link->rx_window[link->rx_expected].valid) // gap filled (Selective Repeat)
+                        link->rx_expected = (link->rx_expected + 1) % link->modulo;
+                    link->rej_sent = FALSE;
+                    send_cframe(link,address_byte,RR_CTRL((link->rx_expected - 1 + link->modulo) % link->modulo));
                     state = 0;
-                } else {
-                    stats.transmitted_rej_frames++;
-                    control_byte = s ? REJ_1 : REJ_0;
-                    state = 1;
+                } else if(offset < link->window) { // a previous frame was lost
+                    if(link->arq_mode == SELECTIVE_REPEAT && !link->rx_window[ns].valid) {
+                        memcpy(link->rx_window[ns].packet, frame, payload_size);
+                        link->rx_window[ns].size = payload_size;
+                        link->rx_window[ns].flags = control_byte & (I_MORE | I_BUNDLE);
+                        link->rx_window[ns].valid = TRUE;
+                    }
+                    if(!link->rej_sent) {
+                        link->stats.transmitted_rej_frames++;
+                        send_cframe(link,address_byte,REJ_CTRL(link->rx_expected));
+                        link->rej_sent = TRUE;
+                    }
+                } else { // already delivered, its RR was lost: acknowledge it again rather than let the sender time out
+                    link->stats.duplicate_i_frames++;
+                    send_cframe(link,address_byte,RR_CTRL((link->rx_expected - 1 + link->modulo) % link->modulo));
                 }
 
-                #if DEBUG
-                    printf("            [%d] parity %d\n",state,s);
-                #endif
-                send_cframe(address_byte,control_byte);
+                TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_RX_EXPECT,state,0,0,link->rx_expected);
             break;
         }
     }
 
-    stats.received_bytes += frame_size - 1;
-    end = time(0);
-    stats.total_time += end - start;
-    if(end - start > stats.slowest_frame)
-        stats.slowest_frame = end - start;
-    if(end - start < stats.fastest_frame)
-        stats.fastest_frame = end - start;
-    return frame_size - 1;
+    link->stats.received_bytes += payload_size;
+    return payload_size;
+}
+
+// Receive data in packet
+// Copies the next payload of the bundle being read to packet, returns its size or -1 if the bundle is malformed
+static int unbundle(linkConnection *link, unsigned char* packet) {
+    int next = link->rx_bundle_next, size = 0;
+    if(next + BUNDLE_HEADER <= link->rx_bundle_size)
+        size = link->rx_bundle[next] << 8 | link->rx_bundle[next + 1];
+    if(next + BUNDLE_HEADER > link->rx_bundle_size || next + BUNDLE_HEADER + size > link->rx_bundle_size) {
+        link->rx_bundle_next = link->rx_bundle_size;
+        return -1;
+    }
+    memcpy(packet,&link->rx_bundle[next + BUNDLE_HEADER],size);
+    link->rx_bundle_next = next + BUNDLE_HEADER + size;
+    return size;
+}
+
+int llread_link(linkConnection *link, unsigned char* packet) {
+    link->start = now_ns();
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_LLREAD,0,0,0,0);
+
+    // The payloads of a bundle are returned one per call
+    if(link->rx_bundle_next < link->rx_bundle_size)
+        return unbundle(link,packet);
+
+    // A payload split by the transmitter comes in several frames, joined here
+    int size = 0, flags = 0;
+    do {
+        int read = read_frame(link,packet + size,link->max_payload - size,&flags);
+        if(read < 0)
+            return -1;
+        size += read;
+    } while(flags & I_MORE);
+
+    hist_record(&link->stats.frame_time,now_ns() - link->start);
+    if(flags & I_BUNDLE) {
+        memcpy(link->rx_bundle,packet,size);
+        link->rx_bundle_size = size;
+        link->rx_bundle_next = 0;
+        return unbundle(link,packet);
+    }
+    return size;
 };
 
+// Largest payload llwrite() accepts and llread() can return, as agreed by both ends in llopen()
+int llmax_payload_link(linkConnection *link) {
+    return link->max_payload;
+}
+
+// Copies the openData the peer sent with SET/UA in llopen() to data, returns how many bytes it sent
+int llpeer_data_link(linkConnection *link, unsigned char *data) {
+    memcpy(data,link->peer_data,link->peer_data_size);
+    return link->peer_data_size;
+}
+
+// Sends the bundle and waits until every frame sent on the link is acknowledged, returns -1 if the link fails
+int llflush_link(linkConnection *link) {
+    tx_lock(link);
+    int result = link->timer_failed || send_bundle(link) < 0 ? -1 : 1;
+    while(result > 0 && outstanding(link) > 0)
+        if(await_ack(link) < 0)
+            result = -1;
+    tx_unlock(link);
+    return result;
+}
+
+// One value of the statistics report, named like a CSV column or JSON key
+typedef struct statField {
+    char name[32];
+    char value[32];
+    int text; // quoted in JSON
+} statField;
+
+#define STATS_FIELDS 64
+
+static int add_field(statField *fields, int n, int text, const char *name, const char *format, ...) {
+    va_list args;
+    va_start(args,format);
+    snprintf(fields[n].name,sizeof(fields[n].name),"%s",name);
+    vsnprintf(fields[n].value,sizeof(fields[n].value),format,args);
+    fields[n].text = text;
+    va_end(args);
+    return n + 1;
+}
+
+static int add_histogram(statField *fields, int n, const char *name, const latencyHistogram *hist) {
+    char key[32];
+    snprintf(key,sizeof(key),"%s_count",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist->count);
+    snprintf(key,sizeof(key),"%s_min_ns",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)(hist->count ? hist->min : 0));
+    snprintf(key,sizeof(key),"%s_mean_ns",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist_mean(hist));
+    snprintf(key,sizeof(key),"%s_p50_ns",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist_percentile(hist,0.5));
+    snprintf(key,sizeof(key),"%s_p99_ns",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist_percentile(hist,0.99));
+    snprintf(key,sizeof(key),"%s_p999_ns",name);
+    n = add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist_percentile(hist,0.999));
+    snprintf(key,sizeof(key),"%s_max_ns",name);
+    return add_field(fields,n,FALSE,key,"%llu",(unsigned long long)hist->max);
+}
+
+static double elapsed_time(linkConnection *link) {
+    return (link->stats.close_time - link->stats.open_time) / 1e9;
+}
+
+// Payload acknowledged (transmitter) or delivered (receiver)
+static long long payload_bytes(linkConnection *link) {
+    return link->parameters.role == TRANSMITTER ? link->stats.acknowledged_bytes : link->stats.received_bytes;
+}
+
+// Payload bits per second the link was open
+static double goodput(linkConnection *link) {
+    double elapsed = elapsed_time(link);
+    return elapsed > 0 ? payload_bytes(link) * 8 / elapsed : 0;
+}
+
+// Goodput against the 8 data bits of every 10 bits a 8N1 line carries at the baud rate
+static double efficiency(linkConnection *link) {
+    return link->baud > 0 ? goodput(link) / (link->baud * 0.8) : 0;
+}
+
+static double retransmission_ratio(linkConnection *link) {
+    return link->stats.transmitted_i_frames ? (double)link->stats.retransmitted_i_frames / link->stats.transmitted_i_frames : 0;
+}
+
+static int stat_fields(linkConnection *link, statField *fields) {
+    struct Statistics *stats = &link->stats;
+    int n = 0;
+    n = add_field(fields,n,TRUE,"role","%s",link->parameters.role == TRANSMITTER ? "tx" : "rx");
+    n = add_field(fields,n,TRUE,"port","%s",link->parameters.serialPort);
+    n = add_field(fields,n,FALSE,"baud","%ld",link->baud);
+    n = add_field(fields,n,FALSE,"window","%d",link->window);
+    n = add_field(fields,n,TRUE,"arq","%s",link->arq_mode == SELECTIVE_REPEAT ? "selective-repeat" : "go-back-n");
+    n = add_field(fields,n,TRUE,"fcs","%s",link->fcs == FCS_CRC32C ? "crc32c" : link->fcs == FCS_CRC16 ? "crc16" : "bcc2");
+    n = add_field(fields,n,FALSE,"max_payload","%d",link->max_payload);
+    n = add_field(fields,n,FALSE,"frame_payload","%d",link->frame_payload);
+    n = add_field(fields,n,FALSE,"smallest_frame_payload","%d",link->stats.smallest_frame_payload);
+    n = add_field(fields,n,FALSE,"frame_resizes","%d",link->stats.frame_resizes);
+    n = add_field(fields,n,FALSE,"elapsed_s","%.6f",elapsed_time(link));
+    n = add_field(fields,n,FALSE,"payload_bytes","%lld",payload_bytes(link));
+    n = add_field(fields,n,FALSE,"goodput_bps","%.0f",goodput(link));
+    n = add_field(fields,n,FALSE,"efficiency","%.4f",efficiency(link));
+    n = add_field(fields,n,FALSE,"transmitted_frames","%d",stats->transmitted_i_frames);
+    n = add_field(fields,n,FALSE,"retransmitted_frames","%d",stats->retransmitted_i_frames);
+    n = add_field(fields,n,FALSE,"retransmission_ratio","%.4f",retransmission_ratio(link));
+    n = add_field(fields,n,FALSE,"timeouts","%d",stats->timeout_counter);
+    n = add_field(fields,n,FALSE,"srtt_ms","%.3f",link->srtt / 1e6);
+    n = add_field(fields,n,FALSE,"rto_ms","%lld",link->rto);
+    n = add_field(fields,n,FALSE,"transmitted_rej_frames","%d",stats->transmitted_rej_frames);
+    n = add_field(fields,n,FALSE,"received_frames","%d",stats->received_i_frames);
+    n = add_field(fields,n,FALSE,"received_rej_frames","%d",stats->received_rej_frames);
+    n = add_field(fields,n,FALSE,"duplicate_frames","%d",stats->duplicate_i_frames);
+    n = add_field(fields,n,FALSE,"fec_parity","%d",link->fec_parity);
+    n = add_field(fields,n,FALSE,"corrected_frames","%d",stats->corrected_i_frames);
+    n = add_field(fields,n,FALSE,"corrected_bytes","%d",stats->corrected_bytes);
+    n = add_field(fields,n,FALSE,"rejected_frames","%d",stats->rejected_i_frames);
+    n = add_field(fields,n,FALSE,"coalesced_payloads","%d",stats->coalesced_payloads);
+    n = add_field(fields,n,FALSE,"bytes_sent","%lld",stats->transmitted_bytes);
+    n = add_field(fields,n,FALSE,"bytes_received","%lld",stats->received_bytes);
+    n = add_field(fields,n,FALSE,"bytes_escaped","%d",stats->escaped_bytes);
+    n = add_histogram(fields,n,"frame_time",&stats->frame_time);
+    n = add_histogram(fields,n,"round_trip",&stats->round_trip);
+    n = add_histogram(fields,n,"ack_time",&stats->ack_time);
+    return add_histogram(fields,n,"retransmit_delay",&stats->retransmit_delay);
+}
+
+static void print_histogram(const char *name, const latencyHistogram *hist) {
+    if(hist->count == 0)
+        return;
+    printf("            %s : p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms (%llu frames)\n", name,
+        hist_percentile(hist,0.5) / 1e6, hist_percentile(hist,0.99) / 1e6, hist_percentile(hist,0.999) / 1e6,
+        hist->max / 1e6, (unsigned long long)hist->count);
+}
+
+// Writes the report to statsFile: JSON replaces the file, CSV appends a row (and the header to a new file)
+static void save_statistics(linkConnection *link) {
+    statField fields[STATS_FIELDS];
+    int count = stat_fields(link,fields);
+    const char *path = link->parameters.statsFile;
+    int csv = link->parameters.statsFormat == STATS_CSV;
+    FILE *file = fopen(path,csv ? "a" : "w");
+    if(file == NULL) {
+        perror(path);
+        return;
+    }
+    if(csv) {
+        fseek(file,0,SEEK_END);
+        if(ftell(file) == 0)
+            for(int i = 0; i < count; i++)
+                fprintf(file,"%s%s",fields[i].name,i + 1 < count ? "," : "\n");
+        for(int i = 0; i < count; i++)
+            fprintf(file,"%s%s",fields[i].value,i + 1 < count ? "," : "\n");
+    } else {
+        fprintf(file,"{\n");
+        for(int i = 0; i < count; i++)
+            fprintf(file,fields[i].text ? "  \"%s\": \"%s\"%s\n" : "  \"%s\": %s%s\n",fields[i].name,fields[i].value,i + 1 < count ? "," : "");
+        fprintf(file,"}\n");
+    }
+    if(fclose(file) != 0)
+        perror(path);
+}
+
 // Closes previously opened connection; if showStatistics==TRUE, link layer should print statistics in the console on close
-int llclose(linkLayer connectionParameters, int showStatistics) {
-    #if DEBUG
-    printf("[linklayer] llclose() closing socket\n");
-    #endif
+int llclose_link(linkConnection *link, int showStatistics) {
+    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_LLCLOSE,0,0,0,0);
+
+    linkLayer connectionParameters = link->parameters;
 
-    int res;
-    unsigned char buf[5];
+    // Frames still in the window must be acknowledged before disconnecting
+    stop_bundle_timer(link);
+    if(llflush_link(link) < 0) {
+        link_free(link);
+        return -1;
+    }
+    link->stats.close_time = now_ns();
 
     if(connectionParameters.role == 0)
-        send_cframe(A_TX,DISC);
+        send_cframe(link,A_TX,DISC);
+    start_timer(link);
 
     int retransmission_counter = 0, state = 1;
     unsigned char byte = 0, address_byte = 0, control_byte = 0;
     while(state) {
-        if(read_timeout(&byte) < 0) {
+        if(read_timeout(link,&byte) < 0) {
             retransmission_counter++;
-            if(retransmission_counter > num_tries)
+            if(retransmission_counter > link->num_tries) {
+                link_free(link);
                 return -1;
+            }
             if(connectionParameters.role == 0)
-                send_cframe(A_TX,DISC);
+                send_cframe(link,A_TX,DISC);
+            start_timer(link);
             state = 1;
         }
         switch(state) {
@@ -534,9 +1834,7 @@ int llclose(linkLayer connectionParameters, int showStatistics) {
             break;
             case 4:
                 if(byte == (address_byte^control_byte)) {
-                    #if DEBUG
-                    printf("            [%d] received %02x and expected %02x\n",state,byte,address_byte^control_byte);
-                    #endif
+                    TRACE_EVENT(&link->trace,TRACE_FRAMES,TRACE_CHECK,state,byte,address_byte^control_byte,0);
                     state = 5;
                 }
                 else if(byte == FLAG)
@@ -552,7 +1850,8 @@ int llclose(linkLayer connectionParameters, int showStatistics) {
 
                 if(control_byte == DISC) {
                     control_byte = connectionParameters.role == 0 ? UA : DISC;
-                    send_cframe(address_byte,control_byte);
+                    send_cframe(link,address_byte,control_byte);
+                    start_timer(link);
                     state = 1;
                 }
 
@@ -563,35 +1862,86 @@ int llclose(linkLayer connectionParameters, int showStatistics) {
         }
     }
 
+    transport_close(&link->io);
 
-    if ( tcsetattr(fd,TCSANOW,&oldtio) == -1) {
-        perror("tcsetattr");
-        exit(-1);
-    }
-    close(fd);
-
-    if(stats.received_i_frames)
-        stats.average_frame_time = stats.total_time / (stats.received_i_frames);
-    if(showStatistics) {    
+    if(showStatistics) {
         printf("[linklayer] llclose() Statistics\n");
-        printf("Baudrate:%d\n",connectionParameters.baudRate);
-        
-        printf("            bytes received: %d\n", stats.received_bytes);
-        printf("            bytes sent: %d\n", stats.transmitted_bytes);
-        printf("            bytes escaped: %d\n", stats.escaped_bytes);
+        printf("Baudrate:%ld\n",link->baud);
+
+        printf("            bytes received: %lld\n", link->stats.received_bytes);
+        printf("            bytes sent: %lld\n", link->stats.transmitted_bytes);
+        printf("            bytes escaped: %d\n", link->stats.escaped_bytes);
 
-        printf("            trasmitted frames: %d\n", stats.transmitted_i_frames);
-        printf("            trasmitted rejection frames : %d\n", stats.transmitted_rej_frames);
+        printf("            trasmitted frames: %d\n", link->stats.transmitted_i_frames);
+        printf("            trasmitted rejection frames : %d\n", link->stats.transmitted_rej_frames);
         
-        printf("            received frames: %d\n", stats.received_i_frames);
-        printf("            received rejection frames : %d\n", stats.received_rej_frames);
+        printf("            received frames: %d\n", link->stats.received_i_frames);
+        printf("            received rejection frames : %d\n", link->stats.received_rej_frames);
+        printf("            received duplicate frames : %d\n", link->stats.duplicate_i_frames);
+        if(link->fec_parity > 0)
+            printf("            corrected frames : %d (%d bytes), rejected frames : %d\n", link->stats.corrected_i_frames, link->stats.corrected_bytes, link->stats.rejected_i_frames);
         
         
-        printf("            Total Time : %ld\n", stats.total_time);
-        printf("            fastest received frame : %ld\n", stats.fastest_frame);
-        printf("            slowest received frame : %ld\n", stats.slowest_frame);
-        printf("            average time for received frames : %ld\n", stats.average_frame_time);
+        printf("            retransmitted frames : %d, ratio %.4f\n", link->stats.retransmitted_i_frames, retransmission_ratio(link));
+        printf("            timeouts : %d\n", link->stats.timeout_counter);
+        if(link->coalesce_delay > 0)
+            printf("            coalesced payloads : %d\n", link->stats.coalesced_payloads);
+        if(link->split)
+            printf("            frame payload : %d bytes, smallest %d, resized %d times\n", link->frame_payload, link->stats.smallest_frame_payload, link->stats.frame_resizes);
 
+        printf("            Total Time : %.6f s\n", elapsed_time(link));
+        printf("            goodput : %.0f bit/s, efficiency %.4f\n", goodput(link), efficiency(link));
+        if(link->stats.frame_time.count) {
+            printf("            fastest frame : %.3f ms\n", link->stats.frame_time.min / 1e6);
+            printf("            slowest frame : %.3f ms\n", link->stats.frame_time.max / 1e6);
+            printf("            average time for frames : %.3f ms\n", hist_mean(&link->stats.frame_time) / 1e6);
+        }
+        print_histogram("round trip",&link->stats.round_trip);
+        print_histogram("time to ACK",&link->stats.ack_time);
+        print_histogram("retransmit delay",&link->stats.retransmit_delay);
     }
+    if(connectionParameters.statsFile[0])
+        save_statistics(link);
+    link_free(link);
     return 1;
 };
+
+// Opens a conection using the "port" parameters defined in struct linkLayer, returns "-1" on error and "1" on sucess
+int llopen(linkLayer connectionParameters) {
+    default_link = llopen_link(connectionParameters);
+    return default_link ? 1 : -1;
+}
+
+// Sends data in buf with size bufSize; returns once the frame fits in the transmission window
+int llwrite(unsigned char* buf, int bufSize) {
+    return default_link ? llwrite_link(default_link,buf,bufSize) : -1;
+}
+
+// Same as llwrite() without copying the payload, gathered from iovcnt buffers that must stay unchanged until the frame is acknowledged
+int llwritev(const struct iovec *iov, int iovcnt) {
+    return default_link ? llwritev_link(default_link,iov,iovcnt) : -1;
+}
+
+// Receive data in packet
+int llread(unsigned char* packet) {
+    return default_link ? llread_link(default_link,packet) : -1;
+}
+
+// Closes previously opened connection; if showStatistics==TRUE, link layer should print statistics in the console on close
+int llclose(linkLayer connectionParameters, int showStatistics) {
+    if(!default_link)
+        return -1;
+    int res = llclose_link(default_link,showStatistics);
+    default_link = NULL;
+    return res;
+}
+
+// Largest payload llwrite() accepts and llread() can return, as agreed by both ends in llopen()
+int llmax_payload() {
+    return default_link ? llmax_payload_link(default_link) : -1;
+}
+
+// Copies the openData the peer sent in llopen() to data, returns how many bytes it sent
+int llpeer_data(unsigned char *data) {
+    return default_link ? llpeer_data_link(default_link,data) : -1;
+}
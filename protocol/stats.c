@@ -0,0 +1,64 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+
+static int bucket_index(uint64_t value) {
+    if(value < (1 << HIST_SUB_BITS))
+        return value;
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (value >> shift);
+}
+
+// Largest value that falls in the bucket
+static uint64_t bucket_value(int index) {
+    if(index < (1 << HIST_SUB_BITS))
+        return index;
+    int shift = index / HIST_HALF - 1;
+    uint64_t sub = index - shift * HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init(latencyHistogram *hist) {
+    memset(hist,0,sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void hist_record(latencyHistogram *hist, uint64_t value) {
+    hist->buckets[bucket_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if(value < hist->min)
+        hist->min = value;
+    if(value > hist->max)
+        hist->max = value;
+}
+
+uint64_t hist_percentile(const latencyHistogram *hist, double quantile) {
+    if(hist->count == 0)
+        return 0;
+    uint64_t rank = quantile * hist->count, seen = 0;
+    if(rank < quantile * hist->count)
+        rank++;
+    if(rank == 0)
+        rank = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if(seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < hist->min ? hist->min : value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+uint64_t hist_mean(const latencyHistogram *hist) {
+    return hist->count ? hist->sum / hist->count : 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
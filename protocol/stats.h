@@ -0,0 +1,29 @@
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+#include <stdint.h>
+
+/*
+ * HDR style histogram of nanosecond latencies: values below 2^HIST_SUB_BITS get a
+ * bucket each, above that every power of two is split into 2^(HIST_SUB_BITS-1)
+ * buckets, so any recorded value is known within 1/2^(HIST_SUB_BITS-1) (about 3%)
+ */
+#define HIST_SUB_BITS 6
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+typedef struct latencyHistogram {
+    uint32_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum, min, max; // exact, ns
+} latencyHistogram;
+
+void hist_init(latencyHistogram *hist);
+void hist_record(latencyHistogram *hist, uint64_t value);
+// Smallest value that quantile (0 to 1) of the recorded values do not exceed, ns; 0 if nothing was recorded
+uint64_t hist_percentile(const latencyHistogram *hist, double quantile);
+uint64_t hist_mean(const latencyHistogram *hist);
+
+// CLOCK_MONOTONIC, ns
+uint64_t now_ns();
+
+#endif
@@ -0,0 +1,301 @@
+#include "stuffing.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#else
+#define X86 0
+#endif
+
+/*
+ * Vector kernels scan 16 (SSE2) or 32 (AVX2) bytes at a time for FLAG/ESC:
+ * clean blocks are copied with a single store and XORed into the BCC2 accumulator,
+ * a block with a special byte copies the run before it and handles that byte alone
+ */
+
+static int stuff_scalar(const unsigned char *data, int size, unsigned char *frame, unsigned char *bcc2, int *escaped) {
+    int n = 0;
+    unsigned char bcc = *bcc2;
+    for(int i = 0; i < size; i++) {
+        bcc ^= data[i];
+        if(data[i] == FLAG || data[i] == ESC) {
+            frame[n++] = ESC;
+            frame[n++] = data[i] ^ ESC_XOR;
+            (*escaped)++;
+        } else {
+            frame[n++] = data[i];
+        }
+    }
+    *bcc2 = bcc;
+    return n;
+}
+
+static int clean_run_scalar(const unsigned char *data, int size, unsigned char *bcc2) {
+    int i = 0;
+    unsigned char bcc = *bcc2;
+    while(i < size && data[i] != FLAG && data[i] != ESC)
+        bcc ^= data[i++];
+    *bcc2 = bcc;
+    return i;
+}
+
+// Consumes one byte that needs no vector handling: FLAG ends the frame, ESC escapes the next byte
+static int destuff_byte(const unsigned char *src, int i, int size, unsigned char *dst, destuffState *state) {
+    unsigned char byte = src[i++];
+    if(state->escape) {
+        byte ^= ESC_XOR;
+        state->escape = 0;
+        state->escaped++;
+    } else if(byte == FLAG) {
+        state->done = 1;
+        return i;
+    } else if(byte == ESC) {
+        state->escape = 1;
+        return i;
+    }
+    dst[state->size++] = byte;
+    state->bcc ^= byte;
+    return i;
+}
+
+static int destuff_scalar(const unsigned char *src, int size, unsigned char *dst, int dst_max, destuffState *state) {
+    int i = 0;
+    while(i < size && !state->done && state->size < dst_max)
+        i = destuff_byte(src,i,size,dst,state);
+    return i;
+}
+
+#if X86
+
+// 32 bytes of 0xff followed by 32 bytes of 0x00, loading at (32 - n) gives a mask of the first n bytes
+static const unsigned char prefix_mask[64] = {
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff
+};
+
+__attribute__((target("sse2")))
+static unsigned char fold_sse2(__m128i acc) {
+    acc = _mm_xor_si128(acc,_mm_srli_si128(acc,8));
+    acc = _mm_xor_si128(acc,_mm_srli_si128(acc,4));
+    acc = _mm_xor_si128(acc,_mm_srli_si128(acc,2));
+    acc = _mm_xor_si128(acc,_mm_srli_si128(acc,1));
+    return _mm_cvtsi128_si32(acc) & 0xff;
+}
+
+__attribute__((target("sse2")))
+static int special_sse2(__m128i v) {
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8(FLAG)),_mm_cmpeq_epi8(v,_mm_set1_epi8(ESC))));
+}
+
+__attribute__((target("sse2")))
+static int stuff_sse2(const unsigned char *data, int size, unsigned char *frame, unsigned char *bcc2, int *escaped) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0, n = 0;
+    while(i + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = special_sse2(v);
+        if(!mask) {
+            _mm_storeu_si128((__m128i *)(frame + n),v);
+            acc = _mm_xor_si128(acc,v);
+            i += 16;
+            n += 16;
+            continue;
+        }
+        int run = __builtin_ctz(mask);
+        acc = _mm_xor_si128(acc,_mm_and_si128(v,_mm_loadu_si128((const __m128i *)(prefix_mask + 32 - run))));
+        memcpy(frame + n,data + i,run);
+        i += run;
+        n += run;
+        acc = _mm_xor_si128(acc,_mm_cvtsi32_si128(data[i]));
+        frame[n++] = ESC;
+        frame[n++] = data[i++] ^ ESC_XOR;
+        (*escaped)++;
+    }
+    *bcc2 ^= fold_sse2(acc);
+    return n + stuff_scalar(data + i,size - i,frame + n,bcc2,escaped);
+}
+
+__attribute__((target("sse2")))
+static int clean_run_sse2(const unsigned char *data, int size, unsigned char *bcc2) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    while(i + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = special_sse2(v);
+        if(mask) {
+            int run = __builtin_ctz(mask);
+            acc = _mm_xor_si128(acc,_mm_and_si128(v,_mm_loadu_si128((const __m128i *)(prefix_mask + 32 - run))));
+            *bcc2 ^= fold_sse2(acc);
+            return i + run;
+        }
+        acc = _mm_xor_si128(acc,v);
+        i += 16;
+    }
+    *bcc2 ^= fold_sse2(acc);
+    return i + clean_run_scalar(data + i,size - i,bcc2);
+}
+
+__attribute__((target("sse2")))
+static int destuff_sse2(const unsigned char *src, int size, unsigned char *dst, int dst_max, destuffState *state) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    while(i < size && !state->done && state->size < dst_max) {
+        if(state->escape || i + 16 > size || state->size + 16 > dst_max) {
+            i = destuff_byte(src,i,size,dst,state);
+            continue;
+        }
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        int mask = special_sse2(v);
+        int run = mask ? __builtin_ctz(mask) : 16;
+        if(run == 16)
+            _mm_storeu_si128((__m128i *)(dst + state->size),v);
+        else
+            memcpy(dst + state->size,src + i,run);
+        acc = _mm_xor_si128(acc,_mm_and_si128(v,_mm_loadu_si128((const __m128i *)(prefix_mask + 32 - run))));
+        i += run;
+        state->size += run;
+        if(run < 16)
+            i = destuff_byte(src,i,size,dst,state);
+    }
+    state->bcc ^= fold_sse2(acc);
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int special_avx2(__m256i v) {
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8(FLAG)),_mm256_cmpeq_epi8(v,_mm256_set1_epi8(ESC))));
+}
+
+__attribute__((target("avx2")))
+static unsigned char fold_avx2(__m256i acc) {
+    return fold_sse2(_mm_xor_si128(_mm256_castsi256_si128(acc),_mm256_extracti128_si256(acc,1)));
+}
+
+__attribute__((target("avx2")))
+static int stuff_avx2(const unsigned char *data, int size, unsigned char *frame, unsigned char *bcc2, int *escaped) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0, n = 0;
+    while(i + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = special_avx2(v);
+        if(!mask) {
+            _mm256_storeu_si256((__m256i *)(frame + n),v);
+            acc = _mm256_xor_si256(acc,v);
+            i += 32;
+            n += 32;
+            continue;
+        }
+        int run = __builtin_ctz(mask);
+        acc = _mm256_xor_si256(acc,_mm256_and_si256(v,_mm256_loadu_si256((const __m256i *)(prefix_mask + 32 - run))));
+        memcpy(frame + n,data + i,run);
+        i += run;
+        n += run;
+        acc = _mm256_xor_si256(acc,_mm256_castsi128_si256(_mm_cvtsi32_si128(data[i])));
+        frame[n++] = ESC;
+        frame[n++] = data[i++] ^ ESC_XOR;
+        (*escaped)++;
+    }
+    *bcc2 ^= fold_avx2(acc);
+    return n + stuff_sse2(data + i,size - i,frame + n,bcc2,escaped);
+}
+
+__attribute__((target("avx2")))
+static int clean_run_avx2(const unsigned char *data, int size, unsigned char *bcc2) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    while(i + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = special_avx2(v);
+        if(mask) {
+            int run = __builtin_ctz(mask);
+            acc = _mm256_xor_si256(acc,_mm256_and_si256(v,_mm256_loadu_si256((const __m256i *)(prefix_mask + 32 - run))));
+            *bcc2 ^= fold_avx2(acc);
+            return i + run;
+        }
+        acc = _mm256_xor_si256(acc,v);
+        i += 32;
+    }
+    *bcc2 ^= fold_avx2(acc);
+    return i + clean_run_sse2(data + i,size - i,bcc2);
+}
+
+__attribute__((target("avx2")))
+static int destuff_avx2(const unsigned char *src, int size, unsigned char *dst, int dst_max, destuffState *state) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    while(i < size && !state->done && state->size < dst_max) {
+        if(state->escape) {
+            i = destuff_byte(src,i,size,dst,state);
+            continue;
+        }
+        if(i + 32 > size || state->size + 32 > dst_max)
+            break;
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        unsigned int mask = special_avx2(v);
+        int run = mask ? __builtin_ctz(mask) : 32;
+        if(run == 32)
+            _mm256_storeu_si256((__m256i *)(dst + state->size),v);
+        else
+            memcpy(dst + state->size,src + i,run);
+        acc = _mm256_xor_si256(acc,_mm256_and_si256(v,_mm256_loadu_si256((const __m256i *)(prefix_mask + 32 - run))));
+        i += run;
+        state->size += run;
+        if(run < 32)
+            i = destuff_byte(src,i,size,dst,state);
+    }
+    state->bcc ^= fold_avx2(acc);
+    if(i < size && !state->done && state->size < dst_max) // tail and escaped bytes
+        i += destuff_sse2(src + i,size - i,dst,dst_max,state);
+    return i;
+}
+
+#endif
+
+static int (*stuff_kernel)(const unsigned char *, int, unsigned char *, unsigned char *, int *) = NULL;
+static int (*destuff_kernel)(const unsigned char *, int, unsigned char *, int, destuffState *) = NULL;
+static int (*clean_run_kernel)(const unsigned char *, int, unsigned char *) = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT; // links in different threads pick the kernel once
+
+static void select_best_kernel() {
+    if(!stuff_kernel)
+        stuffing_select(STUFFING_AVX2);
+}
+
+int stuffing_select(int kernel) {
+    #if X86
+    __builtin_cpu_init();
+    if(kernel >= STUFFING_AVX2 && __builtin_cpu_supports("avx2")) {
+        stuff_kernel = stuff_avx2;
+        destuff_kernel = destuff_avx2;
+        clean_run_kernel = clean_run_avx2;
+        return STUFFING_AVX2;
+    }
+    if(kernel >= STUFFING_SSE2 && __builtin_cpu_supports("sse2")) {
+        stuff_kernel = stuff_sse2;
+        destuff_kernel = destuff_sse2;
+        clean_run_kernel = clean_run_sse2;
+        return STUFFING_SSE2;
+    }
+    #endif
+    stuff_kernel = stuff_scalar;
+    destuff_kernel = destuff_scalar;
+    clean_run_kernel = clean_run_scalar;
+    return STUFFING_SCALAR;
+}
+
+int stuff(const unsigned char *data, int size, unsigned char *frame, unsigned char *bcc2, int *escaped) {
+    pthread_once(&kernel_once,select_best_kernel);
+    return stuff_kernel(data,size,frame,bcc2,escaped);
+}
+
+int clean_run(const unsigned char *data, int size, unsigned char *bcc2) {
+    pthread_once(&kernel_once,select_best_kernel);
+    return clean_run_kernel(data,size,bcc2);
+}
+
+int destuff(const unsigned char *src, int size, unsigned char *dst, int dst_max, destuffState *state) {
+    pthread_once(&kernel_once,select_best_kernel);
+    return destuff_kernel(src,size,dst,dst_max,state);
+}
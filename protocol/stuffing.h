@@ -0,0 +1,31 @@
+#ifndef STUFFING
+#define STUFFING
+
+#define FLAG 0x5c
+#define ESC  0x5d
+#define ESC_XOR 0x20
+
+//KERNEL used for byte stuffing, chosen at runtime from what the CPU supports
+#define STUFFING_SCALAR 0
+#define STUFFING_SSE2 1
+#define STUFFING_AVX2 2
+
+// State of a frame being destuffed, kept between calls while its bytes arrive
+typedef struct destuffState {
+    int size; //number of destuffed bytes written to the destination
+    int escape; //last byte consumed was ESC, the next one still has to be XORed
+    int done; //the FLAG that ends the frame was consumed
+    int escaped; //number of escaped bytes found
+    unsigned char bcc; //XOR of every destuffed byte, 0 when the trailing BCC2 matches
+} destuffState;
+
+// Copies size bytes of data to frame escaping FLAG and ESC, XORs them into *bcc2; returns the number of bytes written (at most 2*size)
+int stuff(const unsigned char *data, int size, unsigned char *frame, unsigned char *bcc2, int *escaped);
+// Returns how many bytes at the start of data need no escaping (up to the first FLAG or ESC) and XORs them into *bcc2
+int clean_run(const unsigned char *data, int size, unsigned char *bcc2);
+// Destuffs src into dst (at most dst_max bytes) until the FLAG that ends the frame; returns the number of bytes consumed from src
+int destuff(const unsigned char *src, int size, unsigned char *dst, int dst_max, destuffState *state);
+// Forces a kernel (falls back to the best one supported), returns the kernel in use
+int stuffing_select(int kernel);
+
+#endif
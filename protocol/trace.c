@@ -0,0 +1,61 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int trace_init(traceRing *ring, int level) {
+    ring->head = 0;
+    ring->records = NULL;
+    ring->level = TRACE_OFF;
+    if(level <= TRACE_OFF)
+        return 1;
+    ring->records = malloc(TRACE_RECORDS * sizeof(traceRecord));
+    if(ring->records == NULL)
+        return -1;
+    ring->level = level;
+    return 1;
+}
+
+void trace_record(traceRing *ring, int event, int state, int byte, int extra, int value) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    traceRecord *record = &ring->records[ring->head++ & (TRACE_RECORDS - 1)];
+    record->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->event = event;
+    record->state = state;
+    record->byte = byte;
+    record->extra = extra;
+    record->value = value;
+}
+
+int trace_save(traceRing *ring, const char *path) {
+    if(ring->records == NULL)
+        return 1;
+    FILE *file = fopen(path,"wb");
+    if(file == NULL) {
+        perror(path);
+        return -1;
+    }
+    traceFileHeader header;
+    memcpy(header.magic,TRACE_MAGIC,sizeof(header.magic));
+    header.count = ring->head < TRACE_RECORDS ? ring->head : TRACE_RECORDS;
+    header.dropped = ring->head - header.count;
+    uint32_t first = ring->head - header.count;
+    uint32_t start = first & (TRACE_RECORDS - 1);
+    uint32_t contiguous = TRACE_RECORDS - start < header.count ? TRACE_RECORDS - start : header.count;
+    int ok = fwrite(&header,sizeof(header),1,file) == 1 &&
+             fwrite(&ring->records[start],sizeof(traceRecord),contiguous,file) == contiguous &&
+             fwrite(ring->records,sizeof(traceRecord),header.count - contiguous,file) == header.count - contiguous;
+    if(fclose(file) != 0 || !ok) {
+        perror(path);
+        return -1;
+    }
+    return 1;
+}
+
+void trace_free(traceRing *ring) {
+    free(ring->records);
+    ring->records = NULL;
+    ring->level = TRACE_OFF;
+}
@@ -0,0 +1,75 @@
+#ifndef TRACE_RING
+#define TRACE_RING
+
+#include <stdint.h>
+
+//LEVEL of detail recorded, chosen per link with linkLayer.traceLevel
+#define TRACE_OFF 0
+#define TRACE_FRAMES 1 // calls, frames sent, header checks, retransmissions and timeouts
+#define TRACE_BYTES 2 // also every byte read by the state machines and every payload byte
+
+#define TRACE_RECORDS 65536 // power of two, the oldest records are overwritten
+
+//EVENTS, the meaning of state/byte/extra/value depends on the event
+#define TRACE_LLOPEN 1
+#define TRACE_LLWRITE 2
+#define TRACE_LLWRITEV 3
+#define TRACE_LLREAD 4
+#define TRACE_LLCLOSE 5
+#define TRACE_SEND_CFRAME 6 // byte: A, extra: C
+#define TRACE_SEND_PFRAME 7 // byte: A, extra: C, value: bytes of parameters
+#define TRACE_RX_BYTE 8 // state, byte read
+#define TRACE_CHECK 9 // state, byte: received, extra: expected
+#define TRACE_PARAMS 10 // state: FCS size, byte: ARQ mode, extra: window, value: maximum payload
+#define TRACE_RETRANSMIT 11 // extra: N(S), value: bytes of data
+#define TRACE_SEND_IFRAME 12 // extra: frames waiting acknowledgement, value: bytes of data
+#define TRACE_TX_HEADER 13 // byte: C, extra: N(S), value: A
+#define TRACE_TX_DATA 14 // byte, value: index in the payload
+#define TRACE_TX_END 15 // byte: BCC2
+#define TRACE_RX_FRAME 16 // state
+#define TRACE_RX_DATA 17 // byte, value: index in the frame
+#define TRACE_RX_END 18 // state, byte: received, extra: expected, value: destuffed size
+#define TRACE_RX_EXPECT 19 // state, value: N(S) expected
+#define TRACE_TIMEOUT 20 // extra: consecutive retries, value: next timeout (ms)
+#define TRACE_BAUD 21 // extra: step of the rate negotiation, value: rate
+#define TRACE_FRAME_SIZE 22 // extra: REJs and timeouts since the last choice, value: payload of the next I frames
+#define TRACE_FEC 23 // state, extra: N(S), value: bytes corrected, -1 if too many errors
+
+// One fixed size record, 16 bytes
+typedef struct traceRecord {
+    uint64_t time; // CLOCK_MONOTONIC, ns
+    uint8_t event;
+    uint8_t state;
+    uint8_t byte;
+    uint8_t extra;
+    int32_t value;
+} traceRecord;
+
+// Trace file: this header followed by count records, oldest first
+typedef struct traceFileHeader {
+    char magic[8]; // TRACE_MAGIC
+    uint32_t count;
+    uint32_t dropped; // records overwritten before the file was written
+} traceFileHeader;
+
+#define TRACE_MAGIC "LLTRACE1"
+
+typedef struct traceRing {
+    traceRecord *records; // NULL when tracing is off
+    uint32_t head; // free running
+    int level;
+} traceRing;
+
+// Allocates the records when level is not TRACE_OFF, returns -1 if there is not enough memory
+int trace_init(traceRing *ring, int level);
+// Appends a record, overwriting the oldest one when the ring is full
+void trace_record(traceRing *ring, int event, int state, int byte, int extra, int value);
+// Writes the ring to path in the trace file format, returns -1 on error
+int trace_save(traceRing *ring, const char *path);
+void trace_free(traceRing *ring);
+
+// Records an event only if the ring keeps that level of detail, the arguments are not evaluated otherwise
+#define TRACE_EVENT(ring,lvl,event,state,byte,extra,value) \
+    do { if((ring)->level >= (lvl)) trace_record(ring,event,state,byte,extra,value); } while(0)
+
+#endif
@@ -0,0 +1,363 @@
+#include "transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+#define QUEUE_SPINS 64
+
+#if defined(__linux__) && defined(TCGETS2)
+/*
+ * struct termios2 of <asm/termbits.h>, which cannot be included next to <termios.h>:
+ * with BOTHER in c_cflag the port runs at c_ispeed/c_ospeed, any rate the UART can divide to
+ */
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#endif
+
+// Rates with a Bxxx constant, cfsetspeed() sets them everywhere
+static const struct {
+    speed_t constant;
+    long rate;
+} speeds[] = {
+    {B0,0}, {B50,50}, {B75,75}, {B110,110}, {B134,134}, {B150,150}, {B200,200}, {B300,300},
+    {B600,600}, {B1200,1200}, {B1800,1800}, {B2400,2400}, {B4800,4800}, {B9600,9600},
+    {B19200,19200}, {B38400,38400}, {B57600,57600}, {B115200,115200}, {B230400,230400},
+    #ifdef B460800
+    {B460800,460800}, {B500000,500000}, {B576000,576000}, {B921600,921600}, {B1000000,1000000},
+    {B1152000,1152000}, {B1500000,1500000}, {B2000000,2000000}, {B2500000,2500000},
+    {B3000000,3000000}, {B3500000,3500000}, {B4000000,4000000},
+    #endif
+};
+#define SPEEDS (sizeof(speeds) / sizeof(speeds[0]))
+
+/*
+ * Single producer single consumer ring: the writer only moves head and the reader only moves tail,
+ * they only take the lock to sleep when the ring is empty (reader) or full (writer) and to wake each other
+ */
+struct byteQueue {
+    unsigned char data[MEMORY_QUEUE_SIZE];
+    atomic_uint head, tail; // free running
+    atomic_int closed;
+    atomic_int sleeping; // threads waiting on wake
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+// Two queues, one per direction; end 0 reads queues[0] and end 1 reads queues[1]
+struct memoryPipe {
+    char name[50];
+    byteQueue queues[2];
+    int opened, users;
+    memoryPipe *next;
+};
+
+static memoryPipe *pipes = NULL;
+static pthread_mutex_t pipes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int queue_readable(byteQueue *q) {
+    return atomic_load(&q->head) != atomic_load(&q->tail) || atomic_load(&q->closed);
+}
+
+static int queue_writable(byteQueue *q) {
+    return atomic_load(&q->head) - atomic_load(&q->tail) < MEMORY_QUEUE_SIZE || atomic_load(&q->closed);
+}
+
+// Sleeps until ready(q) or timeout ms passed (-1: no limit), returns ready(q)
+static int queue_sleep(byteQueue *q, int (*ready)(byteQueue *), int timeout) {
+    for(int i = 0; i < QUEUE_SPINS; i++) { // the other end usually answers sooner than a sleep and wake up take
+        if(ready(q))
+            return 1;
+        sched_yield();
+    }
+    if(timeout == 0)
+        return ready(q);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC,&deadline);
+    if(timeout >= 0) {
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&q->lock);
+    atomic_fetch_add(&q->sleeping,1); // before checking again, so a waker either sees it or we see its bytes
+    int result;
+    while(!(result = ready(q))) {
+        if(timeout < 0)
+            pthread_cond_wait(&q->wake,&q->lock);
+        else if(pthread_cond_timedwait(&q->wake,&q->lock,&deadline) == ETIMEDOUT) {
+            result = ready(q);
+            break;
+        }
+    }
+    atomic_fetch_sub(&q->sleeping,1);
+    pthread_mutex_unlock(&q->lock);
+    return result;
+}
+
+static void queue_wake(byteQueue *q) {
+    if(atomic_load(&q->sleeping) == 0)
+        return;
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_init(byteQueue *q) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&q->wake,&attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&q->lock,NULL);
+    atomic_init(&q->head,0);
+    atomic_init(&q->tail,0);
+    atomic_init(&q->closed,0);
+    atomic_init(&q->sleeping,0);
+}
+
+static void queue_destroy(byteQueue *q) {
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static ssize_t queue_read(byteQueue *q, unsigned char *buf, size_t size) {
+    queue_sleep(q,queue_readable,-1);
+    unsigned int tail = atomic_load_explicit(&q->tail,memory_order_relaxed);
+    unsigned int available = atomic_load_explicit(&q->head,memory_order_acquire) - tail;
+    if(available > size)
+        available = size;
+    unsigned int offset = tail & (MEMORY_QUEUE_SIZE - 1);
+    unsigned int contiguous = MEMORY_QUEUE_SIZE - offset < available ? MEMORY_QUEUE_SIZE - offset : available;
+    memcpy(buf,&q->data[offset],contiguous);
+    memcpy(buf + contiguous,q->data,available - contiguous);
+    atomic_store(&q->tail,tail + available);
+    queue_wake(q);
+    return available; // 0 only once the writer closed the queue
+}
+
+static ssize_t queue_write(byteQueue *q, const unsigned char *buf, size_t size) {
+    size_t written = 0;
+    while(written < size) {
+        queue_sleep(q,queue_writable,-1);
+        if(atomic_load(&q->closed))
+            return -1;
+        unsigned int head = atomic_load_explicit(&q->head,memory_order_relaxed);
+        unsigned int space = MEMORY_QUEUE_SIZE - (head - atomic_load_explicit(&q->tail,memory_order_acquire));
+        if(space > size - written)
+            space = size - written;
+        unsigned int offset = head & (MEMORY_QUEUE_SIZE - 1);
+        unsigned int contiguous = MEMORY_QUEUE_SIZE - offset < space ? MEMORY_QUEUE_SIZE - offset : space;
+        memcpy(&q->data[offset],buf + written,contiguous);
+        memcpy(q->data,buf + written + contiguous,space - contiguous);
+        atomic_store(&q->head,head + space);
+        queue_wake(q);
+        written += space;
+    }
+    return written;
+}
+
+// Connects to the end opened first with the same name or creates a new pipe
+static int memory_open(transport *t, const char *name) {
+    pthread_mutex_lock(&pipes_lock);
+    memoryPipe *pipe = pipes;
+    while(pipe != NULL && (pipe->opened != 1 || strcmp(pipe->name,name) != 0))
+        pipe = pipe->next;
+    if(pipe == NULL) {
+        pipe = calloc(1,sizeof(memoryPipe));
+        if(pipe == NULL) {
+            pthread_mutex_unlock(&pipes_lock);
+            return -1;
+        }
+        snprintf(pipe->name,sizeof(pipe->name),"%s",name);
+        queue_init(&pipe->queues[0]);
+        queue_init(&pipe->queues[1]);
+        pipe->next = pipes;
+        pipes = pipe;
+    }
+    int end = pipe->opened++;
+    pipe->users++;
+    pthread_mutex_unlock(&pipes_lock);
+    t->pipe = pipe;
+    t->rx = &pipe->queues[end];
+    t->tx = &pipe->queues[!end];
+    return 1;
+}
+
+static void memory_close(transport *t) {
+    memoryPipe *pipe = t->pipe;
+    for(int i = 0; i < 2; i++) {
+        atomic_store(&pipe->queues[i].closed,1);
+        queue_wake(&pipe->queues[i]);
+    }
+    pthread_mutex_lock(&pipes_lock);
+    if(--pipe->users == 0) {
+        memoryPipe **link = &pipes;
+        while(*link != pipe)
+            link = &(*link)->next;
+        *link = pipe->next;
+        queue_destroy(&pipe->queues[0]);
+        queue_destroy(&pipe->queues[1]);
+        free(pipe);
+    }
+    pthread_mutex_unlock(&pipes_lock);
+}
+
+long transport_baud(int baudRate) {
+    for(int i = 0; i < SPEEDS; i++)
+        if(speeds[i].constant == baudRate)
+            return speeds[i].rate;
+    return baudRate;
+}
+
+// Sets the rate of both directions once the bytes already written left, through termios2 when there is no Bxxx constant for it
+static int serial_speed(int fd, long rate) {
+    tcdrain(fd);
+    for(int i = 0; i < SPEEDS; i++) {
+        if(speeds[i].rate != rate)
+            continue;
+        struct termios tio;
+        if(tcgetattr(fd,&tio) == -1 || cfsetispeed(&tio,speeds[i].constant) == -1 || cfsetospeed(&tio,speeds[i].constant) == -1)
+            return -1;
+        return tcsetattr(fd,TCSANOW,&tio) == -1 ? -1 : 1;
+    }
+#if defined(__linux__) && defined(TCGETS2)
+    struct termios2 tio;
+    if(ioctl(fd,TCGETS2,&tio) == -1)
+        return -1;
+    tio.c_cflag = (tio.c_cflag & ~CBAUD) | BOTHER;
+    tio.c_ispeed = tio.c_ospeed = rate;
+    return ioctl(fd,TCSETS2,&tio) == -1 ? -1 : 1;
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+static int serial_open(transport *t, const char *port, int baudRate) {
+    t->in = t->out = open(port, O_RDWR | O_NOCTTY );
+    if (t->in < 0) { perror(port); return -1; }
+    if ( tcgetattr(t->in,&t->oldtio) == -1) { /* save current port settings */
+        perror("tcgetattr");
+        close(t->in);
+        return -1;
+    }
+
+    struct termios newtio;
+    bzero(&newtio, sizeof(newtio));
+    newtio.c_cflag = CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME]    = 0;   /* inter-character timer unused */
+    newtio.c_cc[VMIN]     = 1;   /* blocking read until 1 char received */
+
+    tcflush(t->in, TCIOFLUSH);
+
+    if (tcsetattr(t->in,TCSANOW,&newtio) == -1) {
+        perror("tcsetattr");
+        close(t->in);
+        return -1;
+    }
+    if (serial_speed(t->in,transport_baud(baudRate)) < 0) {
+        fprintf(stderr,"%s: cannot set %ld baud\n",port,transport_baud(baudRate));
+        tcsetattr(t->in,TCSANOW,&t->oldtio);
+        close(t->in);
+        return -1;
+    }
+    return 1;
+}
+
+int transport_open(transport *t, const char *port, int baudRate) {
+    memset(t,0,sizeof(*t));
+    t->in = t->out = -1;
+    if(strncmp(port,"mem:",4) == 0) {
+        t->kind = TRANSPORT_MEMORY;
+        return memory_open(t,port + 4);
+    }
+    if(strncmp(port,"fd:",3) == 0) {
+        t->kind = TRANSPORT_FD;
+        int fields = sscanf(port + 3,"%d,%d",&t->in,&t->out);
+        if(fields == 1)
+            t->out = t->in;
+        if(fields < 1 || t->in < 0 || t->out < 0) {
+            fprintf(stderr,"%s: expected fd:<n> or fd:<read>,<write>\n",port);
+            return -1;
+        }
+        return 1;
+    }
+    t->kind = TRANSPORT_SERIAL;
+    return serial_open(t,port,baudRate);
+}
+
+int transport_set_baud(transport *t, long rate) {
+    if(t->kind != TRANSPORT_SERIAL)
+        return 1;
+    return serial_speed(t->in,rate);
+}
+
+ssize_t transport_read(transport *t, void *buf, size_t size) {
+    if(t->kind == TRANSPORT_MEMORY)
+        return queue_read(t->rx,buf,size);
+    return read(t->in,buf,size);
+}
+
+int transport_wait(transport *t, int timeout) {
+    if(t->kind == TRANSPORT_MEMORY)
+        return queue_sleep(t->rx,queue_readable,timeout);
+    struct pollfd pfd = {t->in, POLLIN, 0};
+    int ready = poll(&pfd,1,timeout);
+    if(ready < 0)
+        return errno == EINTR ? 0 : -1;
+    return ready > 0;
+}
+
+ssize_t transport_writev(transport *t, const struct iovec *iov, int iovcnt) {
+    if(t->kind != TRANSPORT_MEMORY)
+        return writev(t->out,iov,iovcnt);
+    ssize_t total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        if(queue_write(t->tx,iov[i].iov_base,iov[i].iov_len) < 0)
+            return -1;
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+ssize_t transport_write(transport *t, const void *buf, size_t size) {
+    struct iovec iov = {(void *)buf, size};
+    return transport_writev(t,&iov,1);
+}
+
+void transport_close(transport *t) {
+    if(t->kind == TRANSPORT_MEMORY) {
+        if(t->pipe != NULL)
+            memory_close(t);
+        t->pipe = NULL;
+    } else if(t->kind == TRANSPORT_SERIAL && t->in >= 0) {
+        if ( tcsetattr(t->in,TCSANOW,&t->oldtio) == -1)
+            perror("tcsetattr");
+        close(t->in);
+    }
+    t->in = t->out = -1;
+}
@@ -0,0 +1,47 @@
+#ifndef TRANSPORT
+#define TRANSPORT
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
+
+/*
+ * Byte stream a link runs on, chosen by the name given as serialPort:
+ * "fd:<n>" or "fd:<read>,<write>"  descriptors the caller already opened (socketpair, pipes), left open on close
+ * "mem:<name>"                     in-process queues, the first two links opened with the same name are connected
+ * anything else                    serial port configured with termios
+ */
+#define TRANSPORT_SERIAL 0
+#define TRANSPORT_FD 1
+#define TRANSPORT_MEMORY 2
+
+#define MEMORY_QUEUE_SIZE (1 << 18) // bytes one end can write before the other reads them (a few of the largest frames), power of two
+
+typedef struct memoryPipe memoryPipe;
+typedef struct byteQueue byteQueue;
+
+typedef struct transport {
+    int kind;
+    int in, out; // TRANSPORT_SERIAL and TRANSPORT_FD
+    struct termios oldtio; // TRANSPORT_SERIAL, restored on close
+    memoryPipe *pipe; // TRANSPORT_MEMORY
+    byteQueue *rx, *tx;
+} transport;
+
+// Opens the byte stream named port, baudRate only applies to serial ports; returns -1 on error
+int transport_open(transport *t, const char *port, int baudRate);
+// Rate in bit/s of baudRate, which is either a Bxxx constant or the rate itself
+long transport_baud(int baudRate);
+// Changes the rate of a serial port (any rate the driver accepts) after what was written is sent, other streams ignore it; returns -1 on error
+int transport_set_baud(transport *t, long rate);
+// Reads up to size bytes, blocking until there is at least one; returns 0 once the peer closed the stream and -1 on error
+ssize_t transport_read(transport *t, void *buf, size_t size);
+// Waits up to timeout ms for bytes to read, returns 1 if there are, 0 on timeout and -1 on error
+int transport_wait(transport *t, int timeout);
+// Writes the buffers, blocking until they fit; returns how many bytes were written or -1 on error
+ssize_t transport_writev(transport *t, const struct iovec *iov, int iovcnt);
+ssize_t transport_write(transport *t, const void *buf, size_t size);
+// Restores the serial port and closes it, the peer of an in-process link reads what is left and then the end of the stream
+void transport_close(transport *t);
+
+#endif
@@ -28,12 +28,12 @@ case $1 in
     ;;
 
     cable)
-        ./bin/cable
+        ./bin/cable "${@:2}"
     ;;
 
     *)
         echo "./run.sh tx        # Transmitter";
         echo "./run.sh rx        # Receiver";
-        echo "./run.sh cable     # Virtual serial port"
+        echo "./run.sh cable     # Virtual serial port, options in README.md"
     ;;
 esac
\ No newline at end of file
@@ -0,0 +1,155 @@
+/*
+ * Renders a link layer trace file as the text the link layer used to print
+ * usage: tracedump [-t] file.trace
+ * -t prefixes every line with the seconds since the first record
+ */
+
+#include "../protocol/trace.h"
+#include "../protocol/stuffing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int timestamps = 0;
+static uint64_t first_time = 0;
+
+static void line_start(const traceRecord *record) {
+    if(timestamps)
+        printf("%12.6f ", (record->time - first_time) / 1e9);
+}
+
+static void render(const traceRecord *record, unsigned char *bcc) {
+    // Payload bytes continue the line of the bytes before them
+    if(record->event == TRACE_TX_DATA || record->event == TRACE_RX_DATA) {
+        if(record->value == 0) {
+            *bcc = 0;
+            line_start(record);
+        }
+        *bcc ^= record->byte;
+        if(record->event == TRACE_TX_DATA && (record->byte == FLAG || record->byte == ESC))
+            printf("ESCAPE ");
+        printf("%02x(%02x) ", record->byte, *bcc);
+        if((record->value + 1) % 16 == 0)
+            printf("\n");
+        return;
+    }
+    if(record->event == TRACE_TX_END) {
+        printf("%02x %02x\n", record->byte, FLAG);
+        return;
+    }
+
+    line_start(record);
+    switch(record->event) {
+        case TRACE_LLOPEN:
+            printf("[linklayer] llopen() opening socket\n");
+        break;
+        case TRACE_LLWRITE:
+            printf("[linklayer] llwrite() write data to socket\n");
+        break;
+        case TRACE_LLWRITEV:
+            printf("[linklayer] llwritev() write data to socket\n");
+        break;
+        case TRACE_LLREAD:
+            printf("[linklayer] llread() reading socket data\n");
+        break;
+        case TRACE_LLCLOSE:
+            printf("[linklayer] llclose() closing socket\n");
+        break;
+        case TRACE_SEND_CFRAME:
+            printf("            [send_cframe] %02x %02x %02x %02x %02x --> \n", FLAG, record->byte, record->extra, record->byte ^ record->extra, FLAG);
+        break;
+        case TRACE_SEND_PFRAME:
+            printf("            [send_pframe] %02x %02x %02x %02x + %d bytes of parameters --> \n", FLAG, record->byte, record->extra, record->byte ^ record->extra, record->value);
+        break;
+        case TRACE_RX_BYTE:
+            printf("            [%d] <-- %02x\n", record->state, record->byte);
+        break;
+        case TRACE_CHECK:
+            printf("            [%d] received %02x and expected %02x\n", record->state, record->byte, record->extra);
+        break;
+        case TRACE_PARAMS:
+            printf("            window %d (%s), FCS %d bytes, payload up to %d bytes\n", record->extra, record->byte ? "Selective Repeat" : "Go-Back-N", record->state, record->value);
+        break;
+        case TRACE_RETRANSMIT:
+            printf("            Retransmitting frame %d with %d bytes of data\n", record->extra, record->value);
+        break;
+        case TRACE_SEND_IFRAME:
+            printf("            [%d] sending %d bytes of data, %d frames waiting acknowledgement\n", record->state, record->value, record->extra);
+        break;
+        case TRACE_TX_HEADER:
+            printf("            [%d] sequence number %d\n", record->state, record->extra);
+            printf("            [%d] constructing packet", record->state);
+            printf("            [%d] %02x %02x %02x %02x --> \n", record->state, FLAG, record->value, record->byte, record->value ^ record->byte);
+        break;
+        case TRACE_RX_FRAME:
+            printf("            [%d] reading frame\n", record->state);
+        break;
+        case TRACE_RX_END:
+            printf("%02x \n", FLAG);
+            printf("\n            [%d] finished reading frame\n", record->state);
+            if(record->value > 0)
+                printf("            [%d] received %02x and expected %02x\n", record->state, record->byte, record->extra);
+        break;
+        case TRACE_RX_EXPECT:
+            printf("            [%d] expecting sequence number %d\n", record->state, record->value);
+        break;
+        case TRACE_TIMEOUT:
+            printf("            timeout, retry %d, next timeout %d ms\n", record->extra, record->value);
+        break;
+        case TRACE_BAUD:
+            printf("            %s %d baud\n", record->extra == 0 ? "switching to" : record->extra == 1 ? "probing" : record->extra == 2 ? "staying at" : "back to", record->value);
+        break;
+        case TRACE_FRAME_SIZE:
+            printf("            %d errors, frames of %d bytes\n", record->extra, record->value);
+        break;
+        case TRACE_FEC:
+            if(record->value < 0)
+                printf("            [%d] frame %d has too many errors to correct\n", record->state, record->extra);
+            else
+                printf("            [%d] frame %d, %d bytes corrected\n", record->state, record->extra, record->value);
+        break;
+        default:
+            printf("            unknown event %d\n", record->event);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1)
+    {
+        if (opt != 't') {
+            printf("usage: tracedump [-t] file.trace\n");
+            exit(1);
+        }
+        timestamps = 1;
+    }
+    if (optind >= argc) {
+        printf("usage: tracedump [-t] file.trace\n");
+        exit(1);
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    traceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a trace file\n", argv[optind]);
+        exit(1);
+    }
+    if (header.dropped)
+        fprintf(stderr, "%u older records were overwritten\n", header.dropped);
+
+    traceRecord record;
+    unsigned char bcc = 0;
+    for (uint32_t i = 0; i < header.count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+        if (i == 0)
+            first_time = record.time;
+        render(&record, &bcc);
+    }
+    fclose(file);
+    return 0;
+}